@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // posix_spawn_file_actions_addtcsetpgrp_np, strsignal
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,8 +13,39 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
+#include <sched.h>
 const char *sysname = "shellax";
 
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+#define HAVE_SPAWN_TCSETPGRP // posix_spawn can hand the terminal to the child
+#endif
+#endif
+
+bool shell_interactive = false; // stdin is a terminal and job control is on
+pid_t shell_pgid;               // process group of the shell itself
+int last_status = 0;            // exit code of the last foreground pipeline
+bool use_spawn = true;          // launch external commands with posix_spawn
+bool parse_quiet = false;       // do not report syntax errors (parser fuzzing)
+
 enum return_codes
 {
     SUCCESS = 0,
@@ -21,15 +53,36 @@ enum return_codes
     UNKNOWN = 2,
 };
 
+enum connector_t
+{
+    CONNECT_ALWAYS = 0, // ; or &: run the next pipeline regardless
+    CONNECT_AND,        // &&: run the next pipeline if this one succeeded
+    CONNECT_OR,         // ||: run the next pipeline if this one failed
+};
+
+struct redirect_t
+{
+    char *path;
+    int fd;      // STDOUT_FILENO or STDERR_FILENO
+    bool append; // >> rather than >
+    struct redirect_t *next;
+};
+
 struct command_t
 {
     char *name;
     bool background;
-    bool auto_complete;
     int arg_count;
     char **args;
-    char *redirects[3];     // in/out redirection
+    char *redirects[5];     // in/out redirection: <, >, >>, 2>, 2>>
+    bool stderr_to_stdout;  // 2>&1, or the stderr half of &>
+    struct redirect_t *fanout; // further output targets of stdout or stderr, in order
+    bool timed;             // prefixed with the time keyword
+    bool scheduled;         // started by the schedule builtin, not the user
     struct command_t *next; // for piping
+    struct command_t *fused; // uniq stage fed directly by this sort stage
+    enum connector_t connector; // how the next pipeline in the list is run
+    struct command_t *chain;    // next pipeline in the list, after ; & && ||
 };
 
 /**
@@ -41,11 +94,13 @@ void print_command(struct command_t *command)
     int i = 0;
     printf("Command: <%s>\n", command->name);
     printf("\tIs Background: %s\n", command->background ? "yes" : "no");
-    printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
     printf("\tRedirects:\n");
-    for (i = 0; i < 3; i++)
+    for (i = 0; i < 5; i++)
         printf("\t\t%d: %s\n", i,
                command->redirects[i] ? command->redirects[i] : "N/A");
+    for (struct redirect_t *r = command->fanout; r != NULL; r = r->next)
+        printf("\t\t%d%s %s\n", r->fd, r->append ? ">>" : ">", r->path);
+    printf("\tStderr to stdout: %s\n", command->stderr_to_stdout ? "yes" : "no");
     printf("\tArguments (%d):\n", command->arg_count);
     for (i = 0; i < command->arg_count; ++i)
         printf("\t\tArg %d: %s\n", i, command->args[i]);
@@ -54,31 +109,12 @@ void print_command(struct command_t *command)
         printf("\tPiped to:\n");
         print_command(command->next);
     }
-}
-/**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
- */
-int free_command(struct command_t *command)
-{
-    if (command->arg_count)
-    {
-        for (int i = 0; i < command->arg_count; ++i)
-            free(command->args[i]);
-        free(command->args);
-    }
-    for (int i = 0; i < 3; ++i)
-        if (command->redirects[i])
-            free(command->redirects[i]);
-    if (command->next)
+    if (command->chain)
     {
-        free_command(command->next);
-        command->next = NULL;
+        const char *connectors[] = {";", "&&", "||"};
+        printf("Then (%s):\n", connectors[command->connector]);
+        print_command(command->chain);
     }
-    free(command->name);
-    free(command);
-    return 0;
 }
 /**
  * Show the command prompt
@@ -92,887 +128,7124 @@ int show_prompt()
     printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
     return 0;
 }
+
+#define ARENA_BLOCK_SIZE 16384 // bytes per arena block, larger requests get their own block
+#define ARENA_ALIGN 16
+
+struct arena_block_t
+{
+    struct arena_block_t *next;
+    size_t size;
+    char data[];
+};
+
+struct arena_t
+{
+    struct arena_block_t *first;   // blocks are kept across resets and reused
+    struct arena_block_t *current; // block allocations are taken from
+    size_t used;                   // bytes used in the current block
+    long allocations;              // since the last reset
+    size_t bytes;                  // since the last reset
+    long total_allocations;        // since the shell started
+    long resets;
+};
+
+static struct arena_t command_arena; // owns everything parsed from one command line
+
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Bump-allocate from an arena. Memory is only given back by arena_reset().
+ * @param  arena [description]
+ * @param  size  [description]
+ * @return       memory aligned to ARENA_ALIGN
  */
-int parse_command(char *buf, struct command_t *command)
+void *arena_alloc(struct arena_t *arena, size_t size)
 {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (arena->current == NULL || arena->used + size > arena->current->size)
     {
-        buf++;
-        len--;
+        // move on to the next kept block if it is big enough, else add one after the current
+        struct arena_block_t *next = arena->current ? arena->current->next : arena->first;
+        if (next == NULL || next->size < size)
+        {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            struct arena_block_t *block = malloc(sizeof(struct arena_block_t) + block_size);
+            block->size = block_size;
+            block->next = next;
+            if (arena->current)
+                arena->current->next = block;
+            else
+                arena->first = block;
+            next = block;
+        }
+        arena->current = next;
+        arena->used = 0;
     }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
+    void *memory = arena->current->data + arena->used;
+    arena->used += size;
+    arena->allocations++;
+    arena->total_allocations++;
+    arena->bytes += size;
+    return memory;
+}
 
-    if (len > 0 && buf[len - 1] == '?') // auto-complete
-        command->auto_complete = true;
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
+/**
+ * Bump-allocate zeroed memory from an arena
+ * @param  arena [description]
+ * @param  size  [description]
+ * @return       [description]
+ */
+void *arena_calloc(struct arena_t *arena, size_t size)
+{
+    return memset(arena_alloc(arena, size), 0, size);
+}
 
-    char *pch = strtok(buf, splitters);
-    if (pch == NULL)
-    {
-        command->name = (char *)malloc(1);
-        command->name[0] = 0;
-    }
-    else
+/**
+ * Free everything allocated from an arena at once, in O(1). The blocks are
+ * kept for the next command line.
+ * @param arena [description]
+ */
+void arena_reset(struct arena_t *arena)
+{
+    arena->current = NULL;
+    arena->used = 0;
+    arena->allocations = 0;
+    arena->bytes = 0;
+    arena->resets++;
+}
+
+/**
+ * Give the blocks of an arena back to malloc
+ * @param arena [description]
+ */
+void arena_destroy(struct arena_t *arena)
+{
+    while (arena->first != NULL)
     {
-        command->name = (char *)malloc(strlen(pch) + 1);
-        strcpy(command->name, pch);
+        struct arena_block_t *next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
     }
+    memset(arena, 0, sizeof(struct arena_t));
+}
 
-    command->args = (char **)malloc(sizeof(char *));
-
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
-    while (1)
+/**
+ * The arena builtin: allocation counters of the command line arena
+ * @param  command [description]
+ * @return         [description]
+ */
+int arena_builtin(struct command_t *command)
+{
+    (void)command;
+    int blocks = 0;
+    size_t retained = 0;
+    for (struct arena_block_t *block = command_arena.first; block != NULL; block = block->next)
     {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch)
-            break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
+        blocks++;
+        retained += block->size;
+    }
+    printf("this line:  %ld allocations, %zu bytes\n", command_arena.allocations, command_arena.bytes);
+    printf("session:    %ld allocations over %ld command lines\n", command_arena.total_allocations,
+           command_arena.resets);
+    printf("blocks:     %d kept, %zu bytes\n", blocks, retained);
+    return SUCCESS;
+}
 
-        if (len == 0)
-            continue;                                        // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-            arg[--len] = 0; // trim right whitespace
-        if (len == 0)
-            continue; // empty arg, go for next
+enum token_type
+{
+    TOKEN_WORD,
+    TOKEN_PIPE,            // |
+    TOKEN_AND,             // &&
+    TOKEN_OR,              // ||
+    TOKEN_SEMICOLON,       // ;
+    TOKEN_BACKGROUND,      // &
+    TOKEN_INPUT,           // <
+    TOKEN_OUTPUT,          // >
+    TOKEN_APPEND,          // >>
+    TOKEN_ERROR_OUTPUT,    // 2>
+    TOKEN_ERROR_APPEND,    // 2>>
+    TOKEN_ERROR_TO_OUTPUT, // 2>&1
+    TOKEN_ALL_OUTPUT,      // &>
+};
 
-        // piping to another command
-        if (strcmp(arg, "|") == 0)
-        {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t')
-                index++; // skip whitespaces
+static const char *token_names[] = {"word", "|", "&&", "||", ";", "&", "<", ">", ">>", "2>", "2>>", "2>&1", "&>"};
 
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
-        }
+struct token_t
+{
+    enum token_type type;
+    char *text;  // unquoted text of a word
+    bool quoted; // the word contained quotes or escapes, so it is never a keyword
+};
 
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
+struct token_list_t
+{
+    struct token_t *tokens;
+    int count;
+    int capacity;
+    char *words; // the unquoted text of every word, NUL separated
+    struct arena_t *arena;
+};
 
-        // handle input redirection
-        redirect_index = -1;
-        if (arg[0] == '<')
-            redirect_index = 0;
-        if (arg[0] == '>')
-        {
-            if (len > 1 && arg[1] == '>')
-            {
-                redirect_index = 2;
-                arg++;
-                len--;
-            }
-            else
-                redirect_index = 1;
-        }
-        if (redirect_index != -1)
+/**
+ * Recognise an operator at the start of p
+ * @param  p          [description]
+ * @param  word_start p starts a new word, where 2> is an operator
+ * @param  type       set to the operator found
+ * @return            length of the operator, 0 if there is none
+ */
+int operator_at(const char *p, bool word_start, enum token_type *type)
+{
+    switch (p[0])
+    {
+    case '|':
+        *type = p[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+        return *type == TOKEN_OR ? 2 : 1;
+    case '&':
+        if (p[1] == '&' || p[1] == '>')
         {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
-            continue;
+            *type = p[1] == '&' ? TOKEN_AND : TOKEN_ALL_OUTPUT;
+            return 2;
         }
-
-        // normal arguments
-        if (len > 2 &&
-            ((arg[0] == '"' && arg[len - 1] == '"') ||
-             (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+        *type = TOKEN_BACKGROUND;
+        return 1;
+    case ';':
+        *type = TOKEN_SEMICOLON;
+        return 1;
+    case '<':
+        *type = TOKEN_INPUT;
+        return 1;
+    case '>':
+        *type = p[1] == '>' ? TOKEN_APPEND : TOKEN_OUTPUT;
+        return *type == TOKEN_APPEND ? 2 : 1;
+    case '2':
+        if (!word_start || p[1] != '>')
+            return 0;
+        if (p[2] == '&' && p[3] == '1')
         {
-            arg[--len] = 0;
-            arg++;
+            *type = TOKEN_ERROR_TO_OUTPUT;
+            return 4;
         }
-        command->args =
-            (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *)malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
+        *type = p[2] == '>' ? TOKEN_ERROR_APPEND : TOKEN_ERROR_OUTPUT;
+        return *type == TOKEN_ERROR_APPEND ? 3 : 2;
     }
-    command->arg_count = arg_index;
-
     return 0;
 }
 
-void prompt_backspace()
+/**
+ * Append a token, doubling the array when it is full
+ * @param list   [description]
+ * @param type   [description]
+ * @param text   [description]
+ * @param quoted [description]
+ */
+void add_token(struct token_list_t *list, enum token_type type, char *text, bool quoted)
 {
-    putchar(8);   // go back 1
-    putchar(' '); // write empty over
-    putchar(8);   // go back 1 again
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        struct token_t *tokens = arena_alloc(list->arena, sizeof(struct token_t) * list->capacity);
+        if (list->count > 0)
+            memcpy(tokens, list->tokens, sizeof(struct token_t) * list->count);
+        list->tokens = tokens;
+    }
+    list->tokens[list->count].type = type;
+    list->tokens[list->count].text = text;
+    list->tokens[list->count].quoted = quoted;
+    list->count++;
 }
+
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Split a command line into words and operators in a single pass. Quotes and
+ * escapes are removed while copying, into one buffer as long as the line.
+ * '...' is taken literally; inside "..." a backslash only escapes " \ $ and `;
+ * elsewhere a backslash escapes any character.
+ * @param  line  [description]
+ * @param  list  filled with the tokens
+ * @param  arena owner of the tokens and words
+ * @return       0 on success, -1 on a syntax error
  */
-int prompt(struct command_t *command)
+int tokenize(const char *line, struct token_list_t *list, struct arena_t *arena)
 {
-    int index = 0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
-
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &=
-        ~(ICANON |
-          ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+    memset(list, 0, sizeof(struct token_list_t));
+    list->arena = arena;
+    char *out = list->words = arena_alloc(arena, strlen(line) + 1); // unquoting never makes a word longer
+    const char *p = line;
+    enum token_type type;
+    int len;
 
-    show_prompt();
-    buf[0] = 0;
     while (1)
     {
-        c = getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-        if (c == 9) // handle tab
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            p++;
+        if (*p == '\0')
+            return 0;
+        if ((len = operator_at(p, true, &type)) > 0)
         {
-            buf[index++] = '?'; // autocomplete
-            break;
+            add_token(list, type, NULL, false);
+            p += len;
+            continue;
         }
 
-        if (c == 127) // handle backspace
+        char *word = out;
+        bool quoted = false;
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && operator_at(p, false, &type) == 0)
         {
-            if (index > 0)
+            if (*p == '\'' || *p == '"')
             {
-                prompt_backspace();
-                index--;
+                char quote = *p++;
+                quoted = true;
+                while (*p != '\0' && *p != quote)
+                {
+                    if (quote == '"' && *p == '\\' && p[1] != '\0' && strchr("\"\\$`", p[1]) != NULL)
+                        p++;
+                    *out++ = *p++;
+                }
+                if (*p == '\0')
+                {
+                    if (!parse_quiet)
+                        printf("-%s: unexpected EOF while looking for matching `%c'\n", sysname, quote);
+                    return -1;
+                }
+                p++; // closing quote
             }
-            continue;
+            else if (*p == '\\' && p[1] != '\0')
+            {
+                quoted = true;
+                *out++ = p[1];
+                p += 2;
+            }
+            else
+                *out++ = *p++;
         }
+        *out++ = '\0';
+        add_token(list, TOKEN_WORD, word, quoted);
+    }
+}
+
+/**
+ * Report a syntax error at a token
+ * @param  tokens [description]
+ * @param  count  [description]
+ * @param  pos    [description]
+ * @return        -1
+ */
+int syntax_error(struct token_t *tokens, int count, int pos)
+{
+    if (!parse_quiet)
+        printf("-%s: syntax error near unexpected token `%s'\n", sysname,
+               pos < count ? token_names[tokens[pos].type] : "newline");
+    return -1;
+}
+
+/**
+ * Parse one simple command: words and redirections up to the next operator
+ * @param  tokens  [description]
+ * @param  count   [description]
+ * @param  pos     index of the next token, advanced past the command
+ * @param  command [description]
+ * @param  arena   [description]
+ * @return         0 on success, -1 on a syntax error
+ */
+int parse_simple_command(struct token_t *tokens, int count, int *pos, struct command_t *command, struct arena_t *arena)
+{
+    // count the words first so args is allocated once, at its final size
+    int words = 0;
+    for (int i = *pos; i < count; i++)
+    {
+        if (tokens[i].type == TOKEN_WORD)
+            words++;
+        else if (tokens[i].type < TOKEN_INPUT)
+            break;
+    }
+    command->args = arena_alloc(arena, sizeof(char *) * (words > 1 ? words - 1 : 1));
 
-        if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68)
+    bool redirected = false;
+    while (*pos < count)
+    {
+        struct token_t *token = &tokens[*pos];
+        if (token->type == TOKEN_WORD)
         {
+            if (command->name == NULL)
+                command->name = token->text;
+            else
+                command->args[command->arg_count++] = token->text;
+            (*pos)++;
             continue;
         }
+        if (token->type < TOKEN_INPUT) // |, ;, &, && or ||
+            break;
 
-        if (c == 65) // up arrow
+        (*pos)++;
+        redirected = true;
+        if (token->type == TOKEN_ERROR_TO_OUTPUT)
         {
-            while (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-
-            char tmpbuf[4096];
-            printf("%s", oldbuf);
-            strcpy(tmpbuf, buf);
-            strcpy(buf, oldbuf);
-            strcpy(oldbuf, tmpbuf);
-            index += strlen(buf);
+            command->stderr_to_stdout = true;
             continue;
         }
-
-        putchar(c); // echo the character
-        buf[index++] = c;
-        if (index >= sizeof(buf) - 1)
+        if (*pos == count || tokens[*pos].type != TOKEN_WORD)
+            return syntax_error(tokens, count, *pos);
+        char *target = tokens[(*pos)++].text;
+        int index;
+        switch (token->type)
+        {
+        case TOKEN_INPUT:
+            command->redirects[0] = target;
+            continue;
+        case TOKEN_OUTPUT:
+            index = 1;
             break;
-        if (c == '\n') // enter key
+        case TOKEN_APPEND:
+            index = 2;
             break;
-        if (c == 4) // Ctrl+D
-            return EXIT;
+        case TOKEN_ERROR_OUTPUT:
+            index = 3;
+            break;
+        case TOKEN_ERROR_APPEND:
+            index = 4;
+            break;
+        default: // &>
+            index = 1;
+            command->stderr_to_stdout = true;
+            break;
+        }
+        // the first target of stdout or stderr goes in redirects, any
+        // further ones are fanned out to as well: cmd > a >> b 2> c
+        int first = index <= 2 ? 1 : 3;
+        if (command->redirects[first] == NULL && command->redirects[first + 1] == NULL)
+        {
+            command->redirects[index] = target;
+            continue;
+        }
+        struct redirect_t *redirect = arena_calloc(arena, sizeof(struct redirect_t));
+        redirect->path = target;
+        redirect->fd = index <= 2 ? STDOUT_FILENO : STDERR_FILENO;
+        redirect->append = index % 2 == 0;
+        struct redirect_t **last = &command->fanout;
+        while (*last != NULL)
+            last = &(*last)->next;
+        *last = redirect;
     }
-    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-        index--;
-    buf[index++] = '\0'; // null terminate string
-
-    strcpy(oldbuf, buf);
 
-    parse_command(buf, command);
+    if (command->name == NULL)
+    {
+        if (!redirected)
+            return syntax_error(tokens, count, *pos);
+        command->name = ""; // only redirections, nothing to run
+    }
+    return 0;
+}
 
-    // print_command(command); // DEBUG: uncomment for debugging
+/**
+ * Parse a pipeline: [time] command [| command]...
+ * @param  tokens  [description]
+ * @param  count   [description]
+ * @param  pos     [description]
+ * @param  command first stage
+ * @param  arena   [description]
+ * @return         0 on success, -1 on a syntax error
+ */
+int parse_pipeline(struct token_t *tokens, int count, int *pos, struct command_t *command, struct arena_t *arena)
+{
+    if (*pos + 1 < count && tokens[*pos].type == TOKEN_WORD && !tokens[*pos].quoted &&
+        strcmp(tokens[*pos].text, "time") == 0 && tokens[*pos + 1].type == TOKEN_WORD)
+    {
+        command->timed = true; // the time keyword
+        (*pos)++;
+    }
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-    return SUCCESS;
+    struct command_t *stage = command;
+    while (1)
+    {
+        if (parse_simple_command(tokens, count, pos, stage, arena) == -1)
+            return -1;
+        if (*pos == count || tokens[*pos].type != TOKEN_PIPE)
+            return 0;
+        (*pos)++;
+        stage->next = arena_calloc(arena, sizeof(struct command_t));
+        stage = stage->next;
+    }
 }
 
-int process_command(struct command_t *command);
-int pipeCommand(struct command_t *command, int *p);
-void runCommand(struct command_t *command);
-void ourUniq(char *input);
-void ourUniqWithCount(char *input);
-int wiseman(struct command_t *command, char *minutes);
-void chatroom(struct command_t *command);
-void sendMessage(char *inputMessage, char users[50][50], int numUsers);
-void guessGame(int guess, int goal, int lower, int higher, int *shot);
-void wordGame(char word[], int *chance);
-// helper functions to color texts in word game:
-void printGameInfo();
-void red();
-void purple();
-void green();
-void blue();
-void yellow();
-void cyan();
-void reset();
-
-int main()
+/**
+ * Parse a list of pipelines separated by ; & && or ||
+ * @param  tokens  [description]
+ * @param  count   [description]
+ * @param  command first stage of the first pipeline
+ * @param  arena   [description]
+ * @return         0 on success, -1 on a syntax error
+ */
+int parse_list(struct token_t *tokens, int count, struct command_t *command, struct arena_t *arena)
 {
+    int pos = 0;
+    struct command_t *pipeline = command;
     while (1)
     {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-        int code;
-        code = prompt(command);
-        if (code == EXIT)
-            break;
-
-        code = process_command(command);
-        if (code == EXIT)
-            break;
-
-        free_command(command);
+        if (parse_pipeline(tokens, count, &pos, pipeline, arena) == -1)
+            return -1;
+        if (pos == count)
+            return 0;
+
+        enum token_type type = tokens[pos++].type;
+        if (type == TOKEN_BACKGROUND)
+            pipeline->background = true;
+        if (pos == count && (type == TOKEN_BACKGROUND || type == TOKEN_SEMICOLON))
+            return 0; // a trailing ; or & ends the list
+        pipeline->connector = type == TOKEN_AND ? CONNECT_AND : type == TOKEN_OR ? CONNECT_OR
+                                                                                : CONNECT_ALWAYS;
+        pipeline->chain = arena_calloc(arena, sizeof(struct command_t));
+        pipeline = pipeline->chain;
     }
-
-    printf("\n");
-    return 0;
 }
 
-int process_command(struct command_t *command)
+/**
+ * Parse a command string into a command struct. Everything it allocates
+ * comes from arena and goes away with the next arena_reset().
+ * @param  buf     [description]
+ * @param  command [description]
+ * @param  arena   [description]
+ * @return         0, -1 on a syntax error (command is then left empty)
+ */
+int parse_command(char *buf, struct command_t *command, struct arena_t *arena)
 {
-    int r;
-    if (strcmp(command->name, "") == 0)
-        return SUCCESS;
-
-    if (strcmp(command->name, "exit") == 0)
-        return EXIT;
-
-    if (strcmp(command->name, "cd") == 0)
+    const char *splitters = " \t"; // split at whitespace
+    int len;
+    len = strlen(buf);
+    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
     {
-        if (command->arg_count > 0)
-        {
-            r = chdir(command->args[0]);
-            if (r == -1)
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            return SUCCESS;
-        }
+        buf++;
+        len--;
     }
+    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
+        buf[--len] = 0; // trim right whitespace
 
-    int connection[2];
-    char message[4096];
-    char message2[4096];
+    struct token_list_t list;
+    int result = tokenize(buf, &list, arena);
+    if (result == 0 && list.count > 0)
+        result = parse_list(list.tokens, list.count, command, arena);
 
-    if (pipe(connection) == -1)
+    if (result == -1 || list.count == 0)
     {
-        printf("Pipe failed\n");
+        memset(command, 0, sizeof(struct command_t));
+        command->name = ""; // nothing to run
+        return result;
     }
+    return 0;
+}
 
-    pid_t pid = fork();
-    if (pid == 0) // child process
-    {
-        /// This shows how to do exec with environ (but is not available on MacOs)
-        // extern char** environ; // environment variables
-        // execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-        /// This shows how to do exec with auto-path resolve
-        // add a NULL argument to the end of args, and the name to the beginning
-        // as required by exec
-
-        // increase args size by 2
-
-        int p[2];
-        pipe(p);
+void prompt_backspace()
+{
+    putchar(8);   // go back 1
+    putchar(' '); // write empty over
+    putchar(8);   // go back 1 again
+}
+#define HISTORY_SIZE 1000             // entries kept in memory unless HISTSIZE says otherwise
+#define HISTORY_COMPACT_SIZE (1 << 22) // rewrite the history file once it grows past this
 
-        if (strcmp(command->name, "word") == 0) // custom command "word": a word guessing game
-        {
-            int chance = 6; // user has 6 chances to guess the word correctly
+struct history_entry_t
+{
+    const char *text; // not NUL terminated: entries loaded at startup point into the mapped file
+    size_t len;
+    unsigned long hash;    // for deduplication
+    unsigned long bigrams; // one bit per character pair, to skip entries in reverse search
+    bool mapped;           // text points into the mapped history file
+};
+
+static struct history_entry_t *history_ring; // oldest entry at history_start
+static int history_start = 0;
+static int history_count = 0;
+static int history_capacity = 0;
+static long history_base = 1; // number shown for the oldest entry
+static int history_fd = -1;   // the history file, opened for appending
+
+/**
+ * The i-th oldest history entry
+ * @param  i [description]
+ * @return   [description]
+ */
+struct history_entry_t *history_at(int i)
+{
+    return &history_ring[(history_start + i) % history_capacity];
+}
+
+/**
+ * Hash of a history line
+ * @param  text [description]
+ * @param  len  [description]
+ * @return      [description]
+ */
+unsigned long history_hash(const char *text, size_t len)
+{
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/**
+ * Bit set of the case-folded character pairs in a string. An entry can only
+ * contain a search string if it has all of the search string's bits.
+ * @param  text [description]
+ * @param  len  [description]
+ * @return      [description]
+ */
+unsigned long bigram_mask(const char *text, size_t len)
+{
+    unsigned long mask = 0;
+    for (size_t i = 0; i + 1 < len; i++)
+        mask |= 1UL << (((tolower((unsigned char)text[i]) * 31) ^ tolower((unsigned char)text[i + 1])) & 63);
+    return mask;
+}
+
+/**
+ * Index of an entry equal to text, -1 if there is none
+ * @param  text [description]
+ * @param  len  [description]
+ * @param  hash [description]
+ * @return      [description]
+ */
+int history_find(const char *text, size_t len, unsigned long hash)
+{
+    for (int i = history_count - 1; i >= 0; i--)
+    {
+        struct history_entry_t *entry = history_at(i);
+        if (entry->hash == hash && entry->len == len && memcmp(entry->text, text, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Add a line to the in-memory ring as the newest entry. An older copy of the
+ * same line is removed; when the ring is full the oldest entry is dropped.
+ * @param text   [description]
+ * @param len    [description]
+ * @param mapped text points into the mapped history file
+ */
+void history_push(const char *text, size_t len, bool mapped)
+{
+    unsigned long hash = history_hash(text, len);
+    int duplicate = history_find(text, len, hash);
+    if (duplicate != -1)
+    {
+        struct history_entry_t *old = history_at(duplicate);
+        if (!old->mapped)
+            free((char *)old->text);
+        for (int i = duplicate; i < history_count - 1; i++)
+            *history_at(i) = *history_at(i + 1);
+        history_count--;
+    }
+    else if (history_count == history_capacity)
+    {
+        struct history_entry_t *oldest = history_at(0);
+        if (!oldest->mapped)
+            free((char *)oldest->text);
+        history_start = (history_start + 1) % history_capacity;
+        history_count--;
+        history_base++;
+    }
 
-            srand(time(NULL));
-            int randomNum = (rand() % 212) + 1; // generates a random number which will be used to choose the word for the game
+    struct history_entry_t *entry = history_at(history_count++);
+    entry->text = text;
+    entry->len = len;
+    entry->hash = hash;
+    entry->bigrams = bigram_mask(text, len);
+    entry->mapped = mapped;
+}
 
-            FILE *textfile;
-            char word[7];
+/**
+ * Path of the history file: $HISTFILE or ~/.shellax_history
+ * @param  path [description]
+ * @param  size [description]
+ * @return      0, -1 if there is no home directory
+ */
+int history_path(char *path, size_t size)
+{
+    const char *file = getenv("HISTFILE");
+    const char *home = getenv("HOME");
+    if (file != NULL)
+        snprintf(path, size, "%s", file);
+    else if (home != NULL)
+        snprintf(path, size, "%s/.shellax_history", home);
+    else
+        return -1;
+    return 0;
+}
 
-            textfile = fopen("words.txt", "r");
-            if (textfile == NULL)
+/**
+ * Load the history. The file is memory-mapped and walked backwards from the
+ * end until the ring is full, so startup does not depend on how long the
+ * file has grown; the entries point straight into the mapping. A file much
+ * longer than the ring is rewritten with just the loaded entries.
+ */
+void init_history()
+{
+    char path[PATH_MAX];
+    const char *size = getenv("HISTSIZE");
+    history_capacity = size != NULL && atoi(size) > 0 ? atoi(size) : HISTORY_SIZE;
+    history_ring = calloc(history_capacity, sizeof(struct history_entry_t));
+    if (history_path(path, sizeof(path)) == -1)
+        return;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            // collect the newest distinct lines, newest first
+            const char **lines = malloc(sizeof(char *) * history_capacity);
+            size_t *lens = malloc(sizeof(size_t) * history_capacity);
+            unsigned long *hashes = malloc(sizeof(unsigned long) * history_capacity);
+            int found = 0;
+            const char *end = data + st.st_size;
+            while (end > data && found < history_capacity)
+            {
+                if (end[-1] == '\n')
+                    end--;
+                const char *newline = memrchr(data, '\n', end - data);
+                const char *start = newline ? newline + 1 : data;
+                size_t len = end - start;
+                unsigned long hash = history_hash(start, len);
+                bool seen = len == 0;
+                for (int i = 0; i < found && !seen; i++)
+                    seen = hashes[i] == hash && lens[i] == len && memcmp(lines[i], start, len) == 0;
+                if (!seen)
+                {
+                    lines[found] = start;
+                    lens[found] = len;
+                    hashes[found++] = hash;
+                }
+                end = start;
+            }
+            for (int i = found - 1; i >= 0; i--)
             {
-                printf("Sorry, could not read.\n");
+                struct history_entry_t *entry = history_at(history_count++);
+                entry->text = lines[i];
+                entry->len = lens[i];
+                entry->hash = hashes[i];
+                entry->bigrams = bigram_mask(lines[i], lens[i]);
+                entry->mapped = true;
             }
+            free(lines);
+            free(lens);
+            free(hashes);
 
-            int count = 0;
-            while (count != randomNum) // reads randomNum many lines from words.txt to find a word to play the game
+            if (st.st_size > HISTORY_COMPACT_SIZE && end > data)
             {
-                fgets(word, 7, textfile);
-                count++;
+                char temp[PATH_MAX + 8];
+                snprintf(temp, sizeof(temp), "%s.tmp", path);
+                FILE *out = fopen(temp, "w");
+                if (out != NULL)
+                {
+                    for (int i = 0; i < history_count; i++)
+                        fprintf(out, "%.*s\n", (int)history_at(i)->len, history_at(i)->text);
+                    if (fclose(out) == 0)
+                        rename(temp, path); // the mapping keeps the old file alive
+                }
             }
-            fclose(textfile);
+        }
+    }
+    if (fd != -1)
+        close(fd);
+    history_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+}
 
-            // prints the necessary information to play the game
-            printGameInfo();
+/**
+ * Record an entered line in memory and append it to the history file
+ * @param line [description]
+ */
+void add_history(const char *line)
+{
+    size_t len = strlen(line);
+    if (len == 0 || history_capacity == 0)
+        return;
+    if (history_count > 0 && history_at(history_count - 1)->len == len &&
+        memcmp(history_at(history_count - 1)->text, line, len) == 0)
+        return; // same as the previous line
+
+    char *text = malloc(len + 1);
+    memcpy(text, line, len);
+    text[len] = '\n';
+    if (history_fd != -1)
+        write(history_fd, text, len + 1);
+    history_push(text, len, false);
+}
 
-            // call the game with the selected word and the number of chances
-            wordGame(word, &chance);
-            exit(0);
-        }
+/**
+ * Find the newest entry at or before index from that contains query
+ * @param  query [description]
+ * @param  len   [description]
+ * @param  from  [description]
+ * @return       index of the entry, -1 if none matches
+ */
+int history_search(const char *query, size_t len, int from)
+{
+    unsigned long mask = bigram_mask(query, len);
+    for (int i = from; i >= 0; i--)
+    {
+        struct history_entry_t *entry = history_at(i);
+        if ((entry->bigrams & mask) == mask && entry->len >= len &&
+            memmem(entry->text, entry->len, query, len) != NULL)
+            return i;
+    }
+    return -1;
+}
 
-        if (strcmp(command->name, "guessGame") == 0) // custom command "guessGame"
+/**
+ * The history builtin: "history [n]" lists the last n entries (all by
+ * default), "history -c" clears the history and its file
+ * @param  command [description]
+ * @return         [description]
+ */
+int history_builtin(struct command_t *command)
+{
+    if (command->arg_count > 0 && strcmp(command->args[0], "-c") == 0)
+    {
+        for (int i = 0; i < history_count; i++)
+            if (!history_at(i)->mapped)
+                free((char *)history_at(i)->text);
+        history_base += history_count;
+        history_count = 0;
+
+        // replace the file rather than truncating it: other sessions have
+        // it mapped, and pages cut off under a mapping raise SIGBUS there
+        char path[PATH_MAX], temp[PATH_MAX + 8];
+        if (history_fd != -1 && history_path(path, sizeof(path)) == 0)
         {
-            if (command->arg_count != 1)
+            snprintf(temp, sizeof(temp), "%s.tmp", path);
+            int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd != -1)
             {
-                printf("Please enter valid arguments\n");
-                exit(0);
-            }
-            else
-            {
-                int size = atoi(command->args[0]);
-                srand(getpid()); // Initialization, should only be called once.
-                int r = rand() % size;
-                int firstGuess;
-                int shott = 1;
-                printf("Welcome to guess game please enter your first guess: ");
-                scanf("%d", &firstGuess);
-                guessGame(firstGuess, r, 0, size, &shott);
-                exit(0);
+                close(fd);
+                if (rename(temp, path) == 0)
+                {
+                    close(history_fd);
+                    history_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+                }
+                else
+                    unlink(temp);
             }
         }
-        if (strcmp(command->name, "chatroom") == 0) // calls the chatroom function when the chatroom command is used
+        return SUCCESS;
+    }
+
+    int shown = command->arg_count > 0 ? atoi(command->args[0]) : history_count;
+    if (shown > history_count || shown < 0)
+        shown = history_count;
+    for (int i = history_count - shown; i < history_count; i++)
+        printf("%5ld  %.*s\n", history_base + i, (int)history_at(i)->len, history_at(i)->text);
+    return SUCCESS;
+}
+
+/**
+ * Replace the edited line on screen and in buf
+ * @param buf   [description]
+ * @param index length of the line, updated
+ * @param text  [description]
+ * @param len   [description]
+ */
+void replace_line(char *buf, int *index, const char *text, size_t len)
+{
+    while (*index > 0)
+    {
+        prompt_backspace();
+        (*index)--;
+    }
+    if (len > 4095)
+        len = 4095;
+    memcpy(buf, text, len);
+    *index = len;
+    printf("%.*s", (int)len, buf);
+}
+
+/**
+ * Ctrl-R: incremental reverse search through the history. Typing narrows the
+ * search, Ctrl-R again finds an older match, Ctrl-G gives up and any other
+ * key takes the match into the line.
+ * @param  buf   [description]
+ * @param  index length of the line, updated
+ * @return       1 if Enter was pressed and the line should run
+ */
+int reverse_search(char *buf, int *index)
+{
+    char query[256];
+    int qlen = 0;
+    int found = -1;
+    int c;
+    while (1)
+    {
+        struct history_entry_t *match = found >= 0 ? history_at(found) : NULL;
+        printf("\r\033[K(reverse-i-search)`%.*s': %.*s", qlen, query, match ? (int)match->len : 0,
+               match ? match->text : "");
+        fflush(stdout);
+
+        c = getchar();
+        if (c == 18) // Ctrl-R: next older match
         {
-            chatroom(command);
-            exit(0);
+            int older = history_search(query, qlen, (found >= 0 ? found : history_count) - 1);
+            if (older != -1)
+                found = older;
+            continue;
         }
-
-        if (strcmp(command->name, "wiseman") == 0) // calls the wiseman function when the wiseman command is used
+        if (c == 127 || c == 8)
         {
-            wiseman(command, command->args[0]);
-            exit(0);
+            if (qlen > 0)
+                qlen--;
+            found = qlen ? history_search(query, qlen, history_count - 1) : -1;
+            continue;
         }
-
-        if (command->next != NULL) // if command includes pipe, calls the pipeCommand function
+        if (c >= 32 && c < 127 && qlen < (int)sizeof(query))
         {
-            pipeCommand(command, p);
+            query[qlen++] = c;
+            found = history_search(query, qlen, found >= 0 ? found : history_count - 1);
+            continue;
         }
 
-        command->args = (char **)realloc(
-            command->args, sizeof(char *) * (command->arg_count += 2));
-
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
-
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
-
-        // TODO: do your own exec with path resolving using execv()
-        // do so by replacing the execvp call below
-        // execvp(command->name, command->args); // exec+args+path
+        printf("\r\033[K");
+        show_prompt();
+        printf("%.*s", *index, buf);
+        if (c == 7 || c == EOF || found < 0) // Ctrl-G: keep the line as it was
+            return 0;
+        match = history_at(found);
+        replace_line(buf, index, match->text, match->len);
+        return c == '\n';
+    }
+}
 
-        char *path = getenv("PATH"); // getting the path to find the given commands' paths.
+int complete_line(char *buf, int *index, int size, bool show_all);
+int prompt_getchar();
 
-        char pathOfCommand[50];
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct command_t *command)
+{
+    int index = 0;
+    int c = 0, last_key;
+    char buf[4096];
+    char draft[4096];                // the line being typed, while browsing the history
+    int draft_len = 0;
+    int history_pos = history_count; // history_count is the line being typed
 
-        const char s[2] = ":";
-        char *token;
+    // tcgetattr gets the parameters of the current terminal
+    // STDIN_FILENO will tell tcgetattr that it should write the settings
+    // of stdin to oldt
+    static struct termios backup_termios, new_termios;
+    tcgetattr(STDIN_FILENO, &backup_termios);
+    new_termios = backup_termios;
+    // ICANON normally takes care that one line at a time will be processed
+    // that means it will return if it sees a "\n" or an EOF or an EOL
+    new_termios.c_lflag &=
+        ~(ICANON |
+          ECHO); // Also disable automatic echo. We manually echo each char.
+    // Those new settings will be set to STDIN
+    // TCSANOW tells tcsetattr to change attributes immediately.
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 
-        // divide the path from each ":" to search every directory
-        token = strtok(path, s);
+    show_prompt();
+    buf[0] = 0;
+    while (1)
+    {
+        last_key = c;
+        c = prompt_getchar();
+        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
 
-        DIR *pDir;
-        struct dirent *entry;
+        if (c == EOF || (c == 4 && index == 0)) // end of input or Ctrl+D on an empty line
+        {
+            tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+            return EXIT;
+        }
 
-        while (token != NULL)
+        if (c == 9) // handle tab, listing the candidates on a second tab
         {
-            pDir = opendir(token);
+            complete_line(buf, &index, sizeof(buf), last_key == 9);
+            last_key = c;
+            continue;
+        }
 
-            if (pDir == NULL)
-            {
-                // return 1;
-            }
-            else
+        if (c == 127 || c == 8) // handle backspace
+        {
+            if (index > 0)
             {
-                while ((entry = readdir(pDir)) != NULL)
-                {
-                    if (strcmp(entry->d_name, command->name) == 0) // find the command's path
-                    {
-                        strcpy(pathOfCommand, "");
-                        strcpy(pathOfCommand, token);
-                        strcat(pathOfCommand, "/");
-                        strcat(pathOfCommand, command->name); // pathOfCommand is the full path of the given command
-                        execv(pathOfCommand, command->args);  // give the path of the command and the arguments to execv()
-                        exit(0);
-                        break;
-                    }
-                    if (command->redirects[1] != NULL || command->redirects[2] != NULL) //---------Check if redirects
-                    {
-                        dup2(connection[1], STDOUT_FILENO); // creates the copy of connection[1]
-                    }
-                }
+                prompt_backspace();
+                index--;
             }
-
-            token = strtok(NULL, s); // search the next directory
+            continue;
         }
-    }
-    else // parent process
-    {
-        // TODO: implement background processes here
-        if (!command->background) //-----------------------------Background
+
+        if (c == 18) // Ctrl-R
         {
-            wait(0); // wait for child process to finish, if the command is not running on the background
-        }
-        if (command->redirects[0] != NULL) // includes <
-        {                                  //-------------------------------- Redirects
-            FILE *inputFile;
-            inputFile = fopen(command->redirects[0], "r"); // open the input file to read
-            fseek(inputFile, 0, SEEK_END);
-            int lenght = ftell(inputFile);
-            fseek(inputFile, 0, SEEK_SET);
-            char *message2 = (char *)malloc(sizeof(char) * (lenght + 1));
-            char inp;
-            message;
-            int i = 0;
-            while (1)
-            {
-                inp = fgetc(inputFile);
-                if (feof(inputFile))
-                {
-                    break;
-                }
-                message2[i] = inp;
-                i++;
-            }
-            message2[i] = '\0';
-            if (command->redirects[1] != NULL) // includes >
-            {
-                close(connection[1]);                           // close the unused end of the file
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[1], "w"); // open the given file to write
-                printf("%s\n", command->redirects[1]);
-                fprintf(ptr, "%s%s", message, message2);
-                fclose(ptr);
-                close(connection[1]);
-            }
-            if (command->redirects[2] != NULL) // includes >>
+            if (reverse_search(buf, &index))
             {
-                close(connection[1]);                           // close the unused end of the file
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[2], "a"); // option "a" appends to the end of the file
-                printf("%s\n", command->redirects[2]);
-                fputs(message, ptr);
-                fprintf(ptr, "%s", message2);
-                fclose(ptr);
-                close(connection[1]);
+                putchar('\n');
+                break;
             }
+            continue;
         }
-        else // no < operation
+
+        if (c == 27) // escape sequence: arrow keys are ESC [ A..D
         {
-            if (command->redirects[1] != NULL) // operation: >
+            if (getchar() != '[')
+                continue;
+            c = getchar();
+            if (c == 'A' && history_pos > 0) // up arrow: older entry
             {
-                close(connection[1]);                           // close the unused end of the pipe
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[1], "w"); // open to file to write
-                printf("%s\n", command->redirects[1]);
-                fprintf(ptr, "%s", message);
-                fclose(ptr);
-                close(connection[1]);
+                if (history_pos == history_count)
+                {
+                    memcpy(draft, buf, index);
+                    draft_len = index;
+                }
+                history_pos--;
+                replace_line(buf, &index, history_at(history_pos)->text, history_at(history_pos)->len);
             }
-            if (command->redirects[2] != NULL) // operation: >>
+            else if (c == 'B' && history_pos < history_count) // down arrow: newer entry
             {
-                close(connection[1]);                           // close the unused end of the pipe
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[2], "a"); // option "a" appends to the end of the file
-                printf("%s\n", command->redirects[2]);
-                fputs(message, ptr);
-                fclose(ptr);
-                close(connection[1]);
+                history_pos++;
+                if (history_pos == history_count)
+                    replace_line(buf, &index, draft, draft_len);
+                else
+                    replace_line(buf, &index, history_at(history_pos)->text, history_at(history_pos)->len);
             }
+            continue;
         }
 
-        return SUCCESS;
+        if (c < 32 && c != '\n') // other control characters
+            continue;
+
+        putchar(c); // echo the character
+        buf[index++] = c;
+        if (index >= (int)sizeof(buf) - 1)
+            break;
+        if (c == '\n') // enter key
+            break;
     }
+    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
+        index--;
+    buf[index++] = '\0'; // null terminate string
+
+    add_history(buf);
+
+    parse_command(buf, command, &command_arena);
 
-    // TODO: your implementation here
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    return UNKNOWN;
+    // print_command(command); // DEBUG: uncomment for debugging
+
+    // restore the old settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+    return SUCCESS;
 }
 
-int pipeCommand(struct command_t *command, int *p)
+int process_command(struct command_t *command);
+int process_pipeline(struct command_t *command);
+unsigned long hash_string(const char *s);
+void hash_refresh_path();
+void hash_clear();
+char *lookup_command(const char *name);
+int hash_builtin(struct command_t *command);
+void init_shell(bool batch);
+int run_batch(int fd, const char *text);
+int run_pipeline(struct command_t *command);
+void exec_stage(struct command_t *command);
+void init_jobs();
+void report_jobs();
+int jobs_builtin(struct command_t *command);
+int fg_bg_builtin(struct command_t *command);
+int wait_builtin(struct command_t *command);
+int kill_builtin(struct command_t *command);
+int bench_builtin(struct command_t *command);
+int stats_builtin(struct command_t *command);
+int schedule_builtin(struct command_t *command);
+void schedule_run_due();
+void schedule_poll(bool wait);
+int redirect_input(struct command_t *command);
+int redirect_output(struct command_t *command);
+int fan_out(struct command_t *command);
+int cache_builtin(struct command_t *command);
+char *map_input(const char *path, size_t *length);
+void uniq_builtin(struct command_t *command, int fd);
+int uniq_command(struct command_t *command);
+int uniq_options_status(struct command_t *command);
+int sort_builtin(struct command_t *command);
+void sort_fuse(struct command_t *command);
+int wiseman(struct command_t *command, char *minutes);
+int wiseman_builtin(struct command_t *command);
+void chatroom(struct command_t *command);
+int chatroom_builtin(struct command_t *command);
+void guessGame(int guess, int goal, int lower, int higher, int *shot);
+int guess_game_builtin(struct command_t *command);
+struct dictionary_t;
+int word_builtin(struct command_t *command);
+void wordGame(struct dictionary_t *dict, const char *word, int *chance);
+// helper functions to color texts in word game:
+void printGameInfo(int length);
+void red();
+void purple();
+void green();
+void blue();
+void yellow();
+void cyan();
+void reset();
+
+#ifndef SHELLAX_FUZZ
+int main(int argc, char *argv[])
 {
-    char word[4096];
-    if (strcmp(command->name, "uniq") == 0) // call the corresponding uniq function if the command is "uniq"
+    // shellax -c 'commands' and shellax script run without a terminal
+    if (argc > 2 && strcmp(argv[1], "-c") == 0)
     {
-        close(p[1]);
-        read(p[0], &word, sizeof(word)); // get the input which "uniq" command will be applied to
-
-        if (command->arg_count > 0) // handles uniq -c
-        {
-            ourUniqWithCount(word);
-        }
-        else // handles uniq
+        init_shell(true);
+        init_jobs();
+        return run_batch(-1, argv[2]);
+    }
+    if (argc > 1)
+    {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
         {
-            ourUniq(word);
+            fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+            return 127;
         }
+        init_shell(true);
+        init_jobs();
+        return run_batch(fd, NULL);
     }
 
-    if (command->next == NULL) // base case for piping
-    {
-        close(0);
-        dup(p[0]); // pass the output to the next command as an input
-        close(p[1]);
-        runCommand(command); // no more pipe, run the last commnand on the output of previous commands
-    }
-    else
+    init_shell(false);
+    init_jobs();
+    if (!shell_interactive) // commands piped into stdin
+        return run_batch(STDIN_FILENO, NULL);
+    init_history();
+    setvbuf(stdin, NULL, _IONBF, 0); // nothing may sit in a stdio buffer while the prompt polls stdin
+    while (1)
     {
-        if (fork() == 0)
-        {
-            close(0);
-            dup(p[0]); // pass the output to the next command as an input
-            close(p[1]);
-            pipeCommand(command->next, p); // recursive call to handle the next pipe
-        }
-        else
-        {
-            close(1);
-            dup(p[1]); // write to pipe - passing the input
-            close(p[0]);
-            runCommand(command); // run command with the input
-        }
+        struct command_t *command = arena_calloc(&command_arena, sizeof(struct command_t));
+
+        report_jobs(); // tell about background jobs that finished since the last prompt
+
+        int code;
+        code = prompt(command);
+        if (code == EXIT)
+            break;
+
+        code = process_command(command);
+        if (code == EXIT)
+            break;
+
+        arena_reset(&command_arena); // free everything parsed from the line at once
     }
-    return 0;
-}
 
-void runCommand(struct command_t *command)
+    printf("\n");
+    return last_status;
+}
+#endif
+
+// Builtins are registered in builtins[], which is indexed by a perfect hash
+// of the name: with BUILTIN_HASH_SEED every registered name lands in its own
+// slot, so a lookup is one hash and one strcmp. A new builtin goes in the
+// slot its name hashes to; if that slot is taken, search for a seed that
+// separates all the names again (try seeds from 1 until builtin_hash() of
+// every name is distinct) and move the entries to their new slots.
+#define BUILTIN_HASH_BITS 5
+#define BUILTIN_HASH_SEED 864u
+
+enum builtin_flags_t
 {
-    // increase args size by 2
-    command->args = (char **)realloc(
-        command->args, sizeof(char *) * (command->arg_count += 2));
+    BUILTIN_FORK = 1,        // always runs in a child of its own: takes over the terminal, or works
+                             // through data and has to stay interruptible and apart from the shell
+    BUILTIN_PIPELINE = 2,    // can be a stage of a pipeline or a background job, in a child
+    BUILTIN_KEEP_STATUS = 4, // sees the status of the previous command
+    BUILTIN_OWN_INPUT = 8,   // opens its "<" file itself
+};
 
-    // shift everything forward by 1
-    for (int i = command->arg_count - 2; i > 0; --i)
-        command->args[i] = command->args[i - 1];
+struct builtin_t
+{
+    const char *name;
+    int (*handler)(struct command_t *command); // sets last_status, returns EXIT to leave the shell
+    int flags;
+};
 
-    command->args[0] = strdup(command->name);
-    command->args[command->arg_count - 1] = NULL;
+/**
+ * exit [n]: leave the shell with status n, or with the last status
+ * @param  command [description]
+ * @return         [description]
+ */
+int exit_builtin(struct command_t *command)
+{
+    if (command->arg_count > 0)
+        last_status = atoi(command->args[0]) & 255;
+    return EXIT;
+}
 
-    char *path = getenv("PATH"); // get the path to search for commands
+/**
+ * cd [dir]: change the shell's directory, to $HOME without an argument
+ * @param  command [description]
+ * @return         [description]
+ */
+int cd_builtin(struct command_t *command)
+{
+    const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+    if (dir != NULL && chdir(dir) == -1)
+    {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        last_status = 1;
+    }
+    return SUCCESS;
+}
+
+static const struct builtin_t builtins[1 << BUILTIN_HASH_BITS] = {
+    [1] = {"stats", stats_builtin, BUILTIN_PIPELINE},
+    [2] = {"bench", bench_builtin, BUILTIN_PIPELINE}, // times launches from the shell, with its SIGCHLD handler
+    [3] = {"arena", arena_builtin, BUILTIN_PIPELINE},
+    [4] = {"hash", hash_builtin, BUILTIN_PIPELINE},
+    [7] = {"uniq", uniq_command, BUILTIN_FORK | BUILTIN_PIPELINE | BUILTIN_OWN_INPUT},
+    [8] = {"chatroom", chatroom_builtin, BUILTIN_FORK | BUILTIN_PIPELINE},
+    [9] = {"kill", kill_builtin, 0},
+    [10] = {"jobs", jobs_builtin, BUILTIN_PIPELINE},
+    [11] = {"history", history_builtin, BUILTIN_PIPELINE},
+    [13] = {"bg", fg_bg_builtin, 0},
+    [14] = {"guessGame", guess_game_builtin, BUILTIN_FORK | BUILTIN_PIPELINE},
+    [16] = {"word", word_builtin, BUILTIN_FORK | BUILTIN_PIPELINE},
+    [17] = {"fg", fg_bg_builtin, 0},
+    [19] = {"cd", cd_builtin, 0},
+    [20] = {"cache", cache_builtin, BUILTIN_FORK | BUILTIN_PIPELINE},
+    [21] = {"sort", sort_builtin, BUILTIN_FORK | BUILTIN_PIPELINE | BUILTIN_OWN_INPUT},
+    [25] = {"exit", exit_builtin, BUILTIN_KEEP_STATUS},
+    [27] = {"schedule", schedule_builtin, 0},
+    [28] = {"wiseman", wiseman_builtin, 0},
+    [31] = {"wait", wait_builtin, 0},
+};
+
+/**
+ * Slot of a name in builtins[]: seeded 32-bit FNV-1a, top bits
+ * @param  name [description]
+ * @return      [description]
+ */
+unsigned builtin_hash(const char *name)
+{
+    uint32_t h = BUILTIN_HASH_SEED;
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h >> (32 - BUILTIN_HASH_BITS);
+}
+
+/**
+ * Find a builtin by name
+ * @param  name [description]
+ * @return      its entry, NULL if name is not a builtin
+ */
+const struct builtin_t *find_builtin(const char *name)
+{
+    const struct builtin_t *builtin = &builtins[builtin_hash(name)];
+    if (builtin->name == NULL || strcmp(builtin->name, name) != 0)
+        return NULL;
+    return builtin;
+}
+
+/**
+ * Check that every name in builtins[] sits in the slot it hashes to. A
+ * table out of step with its seed would quietly send builtins to a PATH
+ * lookup instead, so the shell refuses to start.
+ */
+void check_builtins()
+{
+    for (unsigned i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (builtins[i].name == NULL || builtin_hash(builtins[i].name) == i)
+            continue;
+        fprintf(stderr, "-%s: builtin %s is in slot %u but hashes to %u; reseed BUILTIN_HASH_SEED\n", sysname,
+                builtins[i].name, i, builtin_hash(builtins[i].name));
+        abort();
+    }
+}
+
+/**
+ * Whether a builtin can run in the shell process for this command: only
+ * the ones that act on the shell's own state, alone and in the foreground.
+ * Builtins that are not pipeline-capable always run in the shell.
+ * @param  builtin [description]
+ * @param  command [description]
+ * @return         [description]
+ */
+bool builtin_in_process(const struct builtin_t *builtin, struct command_t *command)
+{
+    if ((builtin->flags & BUILTIN_PIPELINE) == 0)
+        return true;
+    // the fan-out of several output targets needs a process of its own too
+    return (builtin->flags & BUILTIN_FORK) == 0 && command->next == NULL && !command->background &&
+           command->fanout == NULL;
+}
+
+/**
+ * Run a builtin in the shell process. Its redirections are applied by
+ * swapping the standard fds for the duration of the call, then restored.
+ * @param  builtin [description]
+ * @param  command [description]
+ * @return         what the handler returned
+ */
+int run_builtin(const struct builtin_t *builtin, struct command_t *command)
+{
+    bool redirected = command->stderr_to_stdout;
+    for (int i = 0; i < 5; i++)
+        if (command->redirects[i] != NULL)
+            redirected = true;
+    if (!redirected)
+        return builtin->handler(command);
+
+    int saved[3];
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++)
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+
+    int r = SUCCESS;
+    if (((builtin->flags & BUILTIN_OWN_INPUT) == 0 && redirect_input(command) == -1) ||
+        redirect_output(command) == -1)
+        last_status = 1;
+    else
+        r = builtin->handler(command);
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++)
+    {
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+    return r;
+}
+
+/**
+ * Run every pipeline of a command list, honouring ; & && and ||
+ * @param  command [description]
+ * @return         EXIT when the shell should exit
+ */
+int process_command(struct command_t *command)
+{
+    struct command_t *pipeline = command;
+    while (pipeline != NULL)
+    {
+        if (process_pipeline(pipeline) == EXIT)
+            return EXIT;
+        // skip pipelines whose && or || condition does not hold; a skipped
+        // pipeline passes the same status on to its own connector
+        while (pipeline->chain != NULL &&
+               ((pipeline->connector == CONNECT_AND && last_status != 0) ||
+                (pipeline->connector == CONNECT_OR && last_status == 0)))
+            pipeline = pipeline->chain;
+        pipeline = pipeline->chain;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Run one pipeline: builtins that can run in the shell itself are handled
+ * here without a fork, everything else is handed to run_pipeline()
+ * @param  command first stage
+ * @return         [description]
+ */
+int process_pipeline(struct command_t *command)
+{
+    if (strcmp(command->name, "") == 0)
+        return SUCCESS;
+
+    sort_fuse(command); // each sort | uniq runs as a single stage
+    const struct builtin_t *builtin = find_builtin(command->name);
+    if (builtin == NULL || (builtin->flags & BUILTIN_KEEP_STATUS) == 0)
+        last_status = 0;
+
+    hash_refresh_path(); // drop cached command locations whose PATH directory changed
+
+    if (builtin != NULL && builtin_in_process(builtin, command))
+        return run_builtin(builtin, command);
+
+    // resolve every stage in the shell itself so the cache entries outlive the child
+    for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+        if (find_builtin(stage->name) == NULL)
+            lookup_command(stage->name);
+
+    return run_pipeline(command);
+}
+
+/**
+ * Shell initialisation: when attached to a terminal, put the shell in its own
+ * process group in the foreground and ignore the job-control signals meant
+ * for the commands it runs
+ * @param batch running a script or -c string, never interactive
+ */
+void init_shell(bool batch)
+{
+    check_builtins();
+    shell_interactive = !batch && isatty(STDIN_FILENO);
+    if (!shell_interactive)
+        return;
+
+    // wait until we are in the foreground before taking over the terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    setpgid(shell_pgid, shell_pgid);
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+}
+
+#define BATCH_BLOCK_SIZE 65536 // bytes read at a time from a script or pipe
+
+/**
+ * Run commands from a script, a pipe or a -c string without touching the
+ * terminal: input is read in large blocks and split at newlines in place,
+ * and nothing is echoed or prompted.
+ * @param  fd   descriptor to read from, -1 to run text instead
+ * @param  text the -c command string
+ * @return      exit code of the last command
+ */
+int run_batch(int fd, const char *text)
+{
+    size_t capacity = BATCH_BLOCK_SIZE, start = 0, end = 0;
+    char *buf;
+    bool eof = fd == -1;
+    if (fd == -1)
+    {
+        end = strlen(text);
+        capacity = end + 1;
+        buf = malloc(capacity);
+        memcpy(buf, text, end);
+    }
+    else
+        buf = malloc(capacity);
+
+    while (start < end || !eof)
+    {
+        char *newline = memchr(buf + start, '\n', end - start);
+        if (newline == NULL && !eof)
+        {
+            // move the partial line to the front and read the next block behind it
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+            if (capacity - end < BATCH_BLOCK_SIZE / 2)
+            {
+                capacity *= 2;
+                buf = realloc(buf, capacity);
+            }
+            ssize_t n = read(fd, buf + end, capacity - end - 1);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                eof = true;
+            else
+                end += n;
+            continue;
+        }
+
+        char *line = buf + start;
+        if (newline != NULL)
+        {
+            *newline = '\0';
+            start = newline - buf + 1;
+        }
+        else
+        {
+            buf[end] = '\0'; // last line without a newline
+            start = end;
+        }
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (*line == '#') // comments and the #! line
+            continue;
+
+        struct command_t *command = arena_calloc(&command_arena, sizeof(struct command_t));
+        if (parse_command(line, command, &command_arena) == -1)
+            last_status = 2;
+        int code = process_command(command);
+        arena_reset(&command_arena);
+        if (code == EXIT)
+        {
+            free(buf);
+            fflush(stdout);
+            return last_status;
+        }
+        schedule_poll(false);
+        report_jobs(); // forget finished background jobs, quietly
+    }
+    free(buf);
+    schedule_poll(true); // a script that scheduled commands runs on until they are all done
+    fflush(stdout);
+    return last_status;
+}
+
+/**
+ * Record the exit codes of the stages of the last pipeline in $PIPESTATUS
+ * @param statuses [description]
+ * @param count    [description]
+ */
+void set_pipestatus(int *statuses, int count)
+{
+    char value[512];
+    int len = 0;
+    value[0] = '\0';
+    for (int i = 0; i < count && len < (int)sizeof(value) - 12; i++)
+        len += sprintf(value + len, i ? " %d" : "%d", statuses[i]);
+    setenv("PIPESTATUS", value, 1);
+}
+
+/**
+ * Convert a wait status to a shell exit code
+ * @param  status [description]
+ * @return        [description]
+ */
+int exit_code(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 0;
+}
+
+#define STATS_TABLE_SIZE 128 // buckets of the per-command statistics
+
+struct command_stats_t
+{
+    char *name;
+    long runs;
+    double real; // seconds
+    double user;
+    double sys;
+    long maxrss; // largest resident set of any run, in KB
+    long faults; // page faults, minor and major
+    struct command_stats_t *next;
+};
+
+static struct command_stats_t *command_stats[STATS_TABLE_SIZE];
+
+/**
+ * Seconds in a timeval
+ * @param  tv [description]
+ * @return    [description]
+ */
+double timeval_seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Seconds from start to end
+ * @param  start [description]
+ * @param  end   [description]
+ * @return       [description]
+ */
+double elapsed_seconds(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Nanoseconds on the monotonic clock, which all processes share
+ * @return [description]
+ */
+uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Find or create the statistics of a command name
+ * @param  name [description]
+ * @return      [description]
+ */
+struct command_stats_t *find_stats(const char *name)
+{
+    unsigned long bucket = hash_string(name) % STATS_TABLE_SIZE;
+    struct command_stats_t *entry;
+    for (entry = command_stats[bucket]; entry != NULL; entry = entry->next)
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    entry = calloc(1, sizeof(struct command_stats_t));
+    entry->name = strdup(name);
+    entry->next = command_stats[bucket];
+    command_stats[bucket] = entry;
+    return entry;
+}
+
+#define MAX_JOBS 1024 // background and stopped jobs tracked at once
+
+enum job_state
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+};
+
+struct job_t
+{
+    int id; // job number used as %id, always its slot + 1; 0 marks a free slot
+    pid_t pgid;
+    int nprocs;
+    pid_t *pids;      // one process per pipeline stage
+    int *statuses;    // wait status of each process
+    char *proc_state; // enum job_state of each process
+    char *text;       // command line shown by jobs
+    char **names;     // command name of each process, for stats
+    struct rusage *usage;   // resources used by each process, from wait4()
+    struct timespec *end;   // when each process was reaped
+    signed char *fused;     // per process, -1 or the status of the options of the uniq fused into it
+    struct timespec start;  // when the pipeline was started
+    bool background;
+    bool notified;  // the current state has been reported to the user
+    bool timed;     // started with the time keyword
+    bool scheduled; // started by the scheduler: finishing is not reported
+};
+
+static struct job_t jobs[MAX_JOBS];
+static int current_job = 0; // job fg and bg act on when none is named
+
+/**
+ * Block or unblock SIGCHLD around code that touches the job table
+ * @param how  SIG_BLOCK or SIG_UNBLOCK
+ */
+void block_sigchld(int how)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(how, &mask, NULL);
+}
+
+/**
+ * Wait for a SIGCHLD to update the job table. Must be called with SIGCHLD
+ * blocked; it is atomically unblocked while sleeping.
+ */
+void await_sigchld()
+{
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    sigsuspend(&mask);
+}
+
+/**
+ * Overall state of a job: running while any process runs, stopped while any
+ * is stopped, done once all of them have exited
+ * @param  job [description]
+ * @return     [description]
+ */
+enum job_state job_state(struct job_t *job)
+{
+    bool stopped = false;
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        if (job->proc_state[i] == JOB_RUNNING)
+            return JOB_RUNNING;
+        if (job->proc_state[i] == JOB_STOPPED)
+            stopped = true;
+    }
+    return stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+/**
+ * Reap every child that changed state and record it in the job table.
+ * Only async-signal-safe work is done here.
+ * @param sig [description]
+ */
+void sigchld_handler(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        for (int i = 0; i < MAX_JOBS; i++)
+        {
+            if (jobs[i].id == 0)
+                continue;
+            for (int k = 0; k < jobs[i].nprocs; k++)
+            {
+                if (jobs[i].pids[k] != pid)
+                    continue;
+                if (WIFSTOPPED(status))
+                    jobs[i].proc_state[k] = JOB_STOPPED;
+                else if (WIFCONTINUED(status))
+                    jobs[i].proc_state[k] = JOB_RUNNING;
+                else
+                {
+                    jobs[i].statuses[k] = status;
+                    jobs[i].proc_state[k] = JOB_DONE;
+                    jobs[i].usage[k] = usage;
+                    clock_gettime(CLOCK_MONOTONIC, &jobs[i].end[k]);
+                }
+                jobs[i].notified = false;
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Install the SIGCHLD handler that keeps the job table up to date
+ */
+void init_jobs()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    action.sa_flags = SA_RESTART; // do not interrupt reading the prompt
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+/**
+ * Append the command line of one stage to text
+ * @param  text    [description]
+ * @param  stage   [description]
+ * @param  outputs false to leave out the output redirections, which a
+ *                 fused sort holds for its uniq
+ * @return         length of the stage's text, which is only measured if text is NULL
+ */
+size_t stage_text(char *text, struct command_t *stage, bool outputs)
+{
+    const char *ops[5] = {" <", " >", " >>", " 2>", " 2>>"};
+    size_t len = strlen(stage->name);
+    if (text != NULL)
+        strcat(text, stage->name);
+    for (int i = 0; i < stage->arg_count; i++)
+    {
+        len += strlen(stage->args[i]) + 1;
+        if (text != NULL)
+        {
+            strcat(text, " ");
+            strcat(text, stage->args[i]);
+        }
+    }
+    for (int i = 0; i < (outputs ? 5 : 1); i++)
+    {
+        if (stage->redirects[i] == NULL)
+            continue;
+        len += strlen(ops[i]) + strlen(stage->redirects[i]);
+        if (text != NULL)
+        {
+            strcat(text, ops[i]);
+            strcat(text, stage->redirects[i]);
+        }
+    }
+    for (struct redirect_t *r = outputs ? stage->fanout : NULL; r != NULL; r = r->next)
+    {
+        const char *op = ops[(r->fd == STDOUT_FILENO ? 1 : 3) + r->append];
+        len += strlen(op) + strlen(r->path);
+        if (text != NULL)
+        {
+            strcat(text, op);
+            strcat(text, r->path);
+        }
+    }
+    if (outputs && stage->stderr_to_stdout)
+    {
+        len += 5;
+        if (text != NULL)
+            strcat(text, " 2>&1");
+    }
+    return len;
+}
+
+/**
+ * Rebuild the command line of a pipeline for job listings. A sort fused
+ * with its uniq is shown as the two stages that were typed.
+ * @param  command [description]
+ * @return         malloc'd string
+ */
+char *job_text(struct command_t *command)
+{
+    size_t len = 1;
+    for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+    {
+        len += stage_text(NULL, stage, stage->fused == NULL) + 3;
+        if (stage->fused != NULL)
+            len += stage_text(NULL, stage->fused, true) + 3;
+    }
+
+    char *text = malloc(len);
+    text[0] = '\0';
+    for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+    {
+        stage_text(text, stage, stage->fused == NULL);
+        if (stage->fused != NULL)
+        {
+            strcat(text, " | ");
+            stage_text(text, stage->fused, true);
+        }
+        if (stage->next)
+            strcat(text, " | ");
+    }
+    return text;
+}
+
+/**
+ * Add a started pipeline to the job table. Called with SIGCHLD blocked.
+ * @param  command [description]
+ * @param  pgid    [description]
+ * @param  pids    [description]
+ * @param  nprocs  [description]
+ * @param  start   when the first process was started
+ * @return         the job, NULL if the table is full
+ */
+struct job_t *add_job(struct command_t *command, pid_t pgid, pid_t *pids, int nprocs, struct timespec start)
+{
+    int slot = 0;
+    while (slot < MAX_JOBS && jobs[slot].id != 0) // lowest free job number
+        slot++;
+    if (slot == MAX_JOBS)
+        return NULL;
+
+    struct job_t *job = &jobs[slot];
+    job->pgid = pgid;
+    job->nprocs = nprocs;
+    job->pids = malloc(sizeof(pid_t) * nprocs);
+    job->statuses = malloc(sizeof(int) * nprocs);
+    job->proc_state = malloc(nprocs);
+    job->names = malloc(sizeof(char *) * nprocs);
+    job->usage = calloc(nprocs, sizeof(struct rusage));
+    job->end = malloc(sizeof(struct timespec) * nprocs);
+    job->fused = malloc(nprocs);
+    job->start = start;
+    struct command_t *stage = command;
+    for (int i = 0; i < nprocs; i++, stage = stage->next)
+    {
+        job->names[i] = strdup(stage->name);
+        job->end[i] = start;
+        job->pids[i] = pids[i];
+        job->statuses[i] = 127 << 8; // stages that could not be forked
+        job->proc_state[i] = pids[i] > 0 ? JOB_RUNNING : JOB_DONE;
+        job->fused[i] = stage->fused == NULL ? -1 : uniq_options_status(stage->fused);
+    }
+    job->text = job_text(command);
+    job->background = command->background;
+    job->timed = command->timed;
+    job->scheduled = command->scheduled;
+    job->notified = false;
+    job->id = slot + 1;
+    return job;
+}
+
+/**
+ * Add the resources used by every process of a finished job to the
+ * per-command statistics
+ * @param job [description]
+ */
+void account_job(struct job_t *job)
+{
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        if (job->pids[i] <= 0)
+            continue;
+        struct command_stats_t *stats = find_stats(job->names[i]);
+        stats->runs++;
+        stats->real += elapsed_seconds(job->start, job->end[i]);
+        stats->user += timeval_seconds(job->usage[i].ru_utime);
+        stats->sys += timeval_seconds(job->usage[i].ru_stime);
+        stats->faults += job->usage[i].ru_minflt + job->usage[i].ru_majflt;
+        if (job->usage[i].ru_maxrss > stats->maxrss)
+            stats->maxrss = job->usage[i].ru_maxrss;
+    }
+}
+
+/**
+ * Print the time and resources used by a whole pipeline, for the time keyword
+ * @param job [description]
+ */
+void print_job_times(struct job_t *job)
+{
+    struct timespec end = job->start;
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        struct rusage *usage = &job->usage[i];
+        if (elapsed_seconds(end, job->end[i]) > 0)
+            end = job->end[i];
+        timeradd(&total.ru_utime, &usage->ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &usage->ru_stime, &total.ru_stime);
+        if (usage->ru_maxrss > total.ru_maxrss)
+            total.ru_maxrss = usage->ru_maxrss;
+        total.ru_minflt += usage->ru_minflt;
+        total.ru_majflt += usage->ru_majflt;
+        total.ru_nvcsw += usage->ru_nvcsw;
+        total.ru_nivcsw += usage->ru_nivcsw;
+    }
+
+    double real = elapsed_seconds(job->start, end);
+    double user = timeval_seconds(total.ru_utime);
+    double sys = timeval_seconds(total.ru_stime);
+    fprintf(stderr, "\nreal\t%dm%.3fs\n", (int)(real / 60), real - 60 * (int)(real / 60));
+    fprintf(stderr, "user\t%dm%.3fs\n", (int)(user / 60), user - 60 * (int)(user / 60));
+    fprintf(stderr, "sys\t%dm%.3fs\n", (int)(sys / 60), sys - 60 * (int)(sys / 60));
+    fprintf(stderr, "maxrss\t%ld KB\n", total.ru_maxrss);
+    fprintf(stderr, "faults\t%ld minor, %ld major\n", total.ru_minflt, total.ru_majflt);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", total.ru_nvcsw, total.ru_nivcsw);
+}
+
+/**
+ * Release a finished job. Called with SIGCHLD blocked.
+ * @param job [description]
+ */
+void remove_job(struct job_t *job)
+{
+    if (current_job == job->id)
+        current_job = 0;
+    if (job_state(job) == JOB_DONE)
+    {
+        account_job(job);
+        if (job->timed)
+            print_job_times(job);
+    }
+    job->id = 0;
+    for (int i = 0; i < job->nprocs; i++)
+        free(job->names[i]);
+    free(job->names);
+    free(job->usage);
+    free(job->end);
+    free(job->fused);
+    free(job->pids);
+    free(job->statuses);
+    free(job->proc_state);
+    free(job->text);
+}
+
+/**
+ * Find a job from a job spec: %n, %%, %+ or a process id. NULL selects the
+ * current job: the last one stopped or put in the background.
+ * @param  spec [description]
+ * @return      the job, NULL if there is no such job
+ */
+struct job_t *find_job(const char *spec)
+{
+    int id = 0;
+    pid_t pid = 0;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+        id = current_job;
+    else if (spec[0] == '%')
+        id = atoi(spec + 1);
+    else
+        pid = atoi(spec);
+
+    if (id > 0 && id <= MAX_JOBS)
+        return jobs[id - 1].id != 0 ? &jobs[id - 1] : NULL;
+
+    struct job_t *latest = NULL;
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (jobs[i].id == 0)
+            continue;
+        if (pid != 0)
+        {
+            for (int k = 0; k < jobs[i].nprocs; k++)
+                if (jobs[i].pids[k] == pid || jobs[i].pgid == pid)
+                    return &jobs[i];
+        }
+        else if (jobs[i].background)
+            latest = &jobs[i];
+    }
+    return pid == 0 && id == 0 ? latest : NULL; // without a current job, use the newest
+}
+
+/**
+ * Store the result of a finished job in last_status and PIPESTATUS, with a
+ * status for every stage as typed: a uniq fused into its sort gets its own,
+ * which is that of its options unless the process was killed
+ * @param job [description]
+ */
+void record_job_status(struct job_t *job)
+{
+    int *codes = malloc(sizeof(int) * job->nprocs * 2);
+    int count = 0;
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        int code = exit_code(job->statuses[i]);
+        codes[count++] = code;
+        if (job->fused[i] != -1)
+            codes[count++] = job->fused[i] == 0 && WIFSIGNALED(job->statuses[i]) ? code : job->fused[i];
+    }
+    last_status = codes[count - 1];
+    set_pipestatus(codes, count);
+    free(codes);
+}
+
+/**
+ * Wait for a foreground job to finish or stop, then take the terminal back
+ * @param job [description]
+ */
+void wait_for_job(struct job_t *job)
+{
+    block_sigchld(SIG_BLOCK);
+    while (job_state(job) == JOB_RUNNING)
+        await_sigchld();
+
+    if (shell_interactive)
+        tcsetpgrp(STDIN_FILENO, shell_pgid); // take the terminal back
+
+    if (job_state(job) == JOB_STOPPED)
+    {
+        job->background = true;
+        job->notified = true;
+        current_job = job->id;
+        last_status = 128 + SIGTSTP;
+        printf("\n[%d]+  Stopped\t\t%s\n", job->id, job->text);
+    }
+    else
+    {
+        record_job_status(job);
+        remove_job(job);
+    }
+    block_sigchld(SIG_UNBLOCK);
+}
+
+/**
+ * Continue a stopped job in the foreground or in the background
+ * @param job        [description]
+ * @param foreground [description]
+ */
+void continue_job(struct job_t *job, bool foreground)
+{
+    block_sigchld(SIG_BLOCK);
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->proc_state[i] == JOB_STOPPED)
+            job->proc_state[i] = JOB_RUNNING;
+    job->notified = true;
+    job->background = !foreground;
+    block_sigchld(SIG_UNBLOCK);
+
+    if (foreground)
+    {
+        printf("%s\n", job->text);
+        if (shell_interactive)
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        kill(-job->pgid, SIGCONT);
+        wait_for_job(job);
+    }
+    else
+    {
+        current_job = job->id;
+        printf("[%d]+ %s &\n", job->id, job->text);
+        kill(-job->pgid, SIGCONT);
+    }
+}
+
+/**
+ * Print the background jobs that finished or stopped since the last prompt.
+ * A shell that is not interactive forgets finished jobs without a word.
+ */
+void report_jobs()
+{
+    block_sigchld(SIG_BLOCK);
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        struct job_t *job = &jobs[i];
+        if (job->id == 0 || !job->background || job->notified)
+            continue;
+        enum job_state state = job_state(job);
+        if (state == JOB_DONE && (job->scheduled || !shell_interactive))
+            remove_job(job);
+        else if (state == JOB_DONE)
+        {
+            int status = job->statuses[job->nprocs - 1];
+            int code = exit_code(status);
+            if (code == 0)
+                printf("[%d]   Done\t\t\t%s\n", job->id, job->text);
+            else if (WIFSIGNALED(status))
+                printf("[%d]   %s\t\t%s\n", job->id, strsignal(WTERMSIG(status)), job->text);
+            else
+                printf("[%d]   Exit %d\t\t%s\n", job->id, code, job->text);
+            remove_job(job);
+        }
+        else if (state == JOB_STOPPED && shell_interactive)
+        {
+            printf("[%d]+  Stopped\t\t%s\n", job->id, job->text);
+            job->notified = true;
+        }
+    }
+    block_sigchld(SIG_UNBLOCK);
+}
+
+/**
+ * The jobs builtin: list background and stopped jobs, -l adds the pids
+ * @param  command [description]
+ * @return         [description]
+ */
+int jobs_builtin(struct command_t *command)
+{
+    bool long_format = command->arg_count > 0 && strcmp(command->args[0], "-l") == 0;
+    block_sigchld(SIG_BLOCK);
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        struct job_t *job = &jobs[i];
+        if (job->id == 0 || !job->background || job->scheduled) // scheduled runs are listed by "schedule"
+            continue;
+        const char *states[] = {"Running", "Stopped", "Done"};
+        printf("[%d]%c  ", job->id, job->id == current_job ? '+' : ' ');
+        if (long_format)
+            printf("%d ", job->pgid);
+        printf("%-8s\t\t%s%s\n", states[job_state(job)], job->text,
+               job_state(job) == JOB_RUNNING ? " &" : "");
+    }
+    block_sigchld(SIG_UNBLOCK);
+    return SUCCESS;
+}
+
+/**
+ * The fg and bg builtins
+ * @param  command [description]
+ * @return         [description]
+ */
+int fg_bg_builtin(struct command_t *command)
+{
+    bool foreground = strcmp(command->name, "fg") == 0;
+    struct job_t *job = find_job(command->arg_count > 0 ? command->args[0] : NULL);
+    if (job == NULL)
+    {
+        printf("-%s: %s: %s: no such job\n", sysname, command->name,
+               command->arg_count > 0 ? command->args[0] : "current");
+        last_status = 1;
+        return SUCCESS;
+    }
+    continue_job(job, foreground);
+    return SUCCESS;
+}
+
+/**
+ * The wait builtin: "wait" waits for every background job, "wait -n" for the
+ * next one to finish and "wait %n|pid..." for the given jobs
+ * @param  command [description]
+ * @return         [description]
+ */
+int wait_builtin(struct command_t *command)
+{
+    block_sigchld(SIG_BLOCK);
+    if (command->arg_count == 0 || strcmp(command->args[0], "-n") == 0)
+    {
+        bool any = command->arg_count > 0;
+        bool was_running[MAX_JOBS];
+        bool waiting = true;
+        int running = 0;
+        for (int i = 0; i < MAX_JOBS; i++)
+        {
+            was_running[i] = jobs[i].id != 0 && job_state(&jobs[i]) == JOB_RUNNING;
+            running += was_running[i];
+        }
+        if (any && running == 0)
+            last_status = 127;
+        while (waiting && running > 0)
+        {
+            waiting = false;
+            for (int i = 0; i < MAX_JOBS; i++)
+            {
+                if (!was_running[i])
+                    continue;
+                if (job_state(&jobs[i]) == JOB_RUNNING)
+                    waiting = true;
+                else if (any) // the first job to finish ends wait -n
+                {
+                    last_status = exit_code(jobs[i].statuses[jobs[i].nprocs - 1]);
+                    waiting = false;
+                    break;
+                }
+            }
+            if (waiting)
+                await_sigchld();
+        }
+        if (!any)
+            last_status = 0;
+    }
+    else
+    {
+        for (int i = 0; i < command->arg_count; i++)
+        {
+            struct job_t *job = find_job(command->args[i]);
+            if (job == NULL)
+            {
+                printf("-%s: wait: %s: no such job\n", sysname, command->args[i]);
+                last_status = 127;
+                continue;
+            }
+            while (job_state(job) == JOB_RUNNING)
+                await_sigchld();
+            last_status = exit_code(job->statuses[job->nprocs - 1]);
+        }
+    }
+    block_sigchld(SIG_UNBLOCK);
+    return SUCCESS;
+}
+
+/**
+ * Order statistics by total real time, largest first
+ */
+int compare_stats(const void *a, const void *b)
+{
+    double x = (*(struct command_stats_t **)a)->real;
+    double y = (*(struct command_stats_t **)b)->real;
+    return (x < y) - (x > y);
+}
+
+/**
+ * The stats builtin: time and resources used per command name over the
+ * session, most expensive first. "stats -r" starts over.
+ * @param  command [description]
+ * @return         [description]
+ */
+int stats_builtin(struct command_t *command)
+{
+    bool reset = command->arg_count > 0 && strcmp(command->args[0], "-r") == 0;
+    int count = 0;
+    for (int i = 0; i < STATS_TABLE_SIZE; i++)
+        for (struct command_stats_t *entry = command_stats[i]; entry != NULL; entry = entry->next)
+            count++;
+
+    struct command_stats_t **sorted = malloc(sizeof(struct command_stats_t *) * (count + 1));
+    count = 0;
+    for (int i = 0; i < STATS_TABLE_SIZE; i++)
+        for (struct command_stats_t *entry = command_stats[i]; entry != NULL; entry = entry->next)
+            sorted[count++] = entry;
+
+    if (reset)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            free(sorted[i]->name);
+            free(sorted[i]);
+        }
+        memset(command_stats, 0, sizeof(command_stats));
+    }
+    else
+    {
+        qsort(sorted, count, sizeof(struct command_stats_t *), compare_stats);
+        printf("%-16s %6s %10s %10s %10s %10s %10s %10s\n", "command", "runs", "real", "avg",
+               "user", "sys", "maxrss KB", "faults");
+        for (int i = 0; i < count; i++)
+            printf("%-16s %6ld %10.3f %10.3f %10.3f %10.3f %10ld %10ld\n", sorted[i]->name, sorted[i]->runs,
+                   sorted[i]->real, sorted[i]->real / sorted[i]->runs, sorted[i]->user, sorted[i]->sys,
+                   sorted[i]->maxrss, sorted[i]->faults);
+    }
+    free(sorted);
+    return SUCCESS;
+}
+
+static const struct
+{
+    const char *name;
+    int number;
+} signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+};
+
+/**
+ * Convert a signal name (TERM, SIGTERM) or number to a signal number
+ * @param  name [description]
+ * @return      the signal, -1 if unknown
+ */
+int parse_signal(const char *name)
+{
+    if (name[0] >= '0' && name[0] <= '9')
+        return atoi(name);
+    if (strncasecmp(name, "SIG", 3) == 0)
+        name += 3;
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++)
+        if (strcasecmp(name, signal_names[i].name) == 0)
+            return signal_names[i].number;
+    return -1;
+}
+
+/**
+ * The kill builtin: kill [-SIG | -s SIG | -l] %n|pid...
+ * A job spec signals the whole process group of the job.
+ * @param  command [description]
+ * @return         [description]
+ */
+int kill_builtin(struct command_t *command)
+{
+    int sig = SIGTERM;
+    int i = 0;
+    if (command->arg_count > 0 && strcmp(command->args[0], "-l") == 0)
+    {
+        for (size_t k = 0; k < sizeof(signal_names) / sizeof(signal_names[0]); k++)
+            printf("%2d) SIG%s\n", signal_names[k].number, signal_names[k].name);
+        return SUCCESS;
+    }
+    if (command->arg_count > 1 && strcmp(command->args[0], "-s") == 0)
+    {
+        sig = parse_signal(command->args[1]);
+        i = 2;
+    }
+    else if (command->arg_count > 0 && command->args[0][0] == '-')
+    {
+        sig = parse_signal(command->args[0] + 1);
+        i = 1;
+    }
+    if (sig == -1)
+    {
+        printf("-%s: kill: %s: invalid signal specification\n", sysname, command->args[i - 1]);
+        last_status = 1;
+        return SUCCESS;
+    }
+
+    last_status = 0;
+    for (; i < command->arg_count; i++)
+    {
+        pid_t target;
+        if (command->args[i][0] == '%')
+        {
+            block_sigchld(SIG_BLOCK);
+            struct job_t *job = find_job(command->args[i]);
+            target = job ? -job->pgid : 0;
+            block_sigchld(SIG_UNBLOCK);
+            if (target == 0)
+            {
+                printf("-%s: kill: %s: no such job\n", sysname, command->args[i]);
+                last_status = 1;
+                continue;
+            }
+        }
+        else
+            target = atoi(command->args[i]);
+        if (target == 0 || kill(target, sig) == -1)
+        {
+            printf("-%s: kill: %s: %s\n", sysname, command->args[i],
+                   target == 0 ? "arguments must be process or job IDs" : strerror(errno));
+            last_status = 1;
+        }
+    }
+    return SUCCESS;
+}
+
+#define MAX_SCHEDULED 256 // timers the scheduler holds at once
+
+struct schedule_entry_t
+{
+    int id;
+    uint64_t due;    // CLOCK_MONOTONIC nanoseconds
+    uint64_t period; // nanoseconds between runs, 0 to run once
+    char *text;      // command line to run
+};
+
+static struct schedule_entry_t *schedule_heap[MAX_SCHEDULED]; // min-heap on due
+static int schedule_count = 0;
+static int schedule_next_id = 1;
+static int schedule_fd = -1;        // timerfd armed for the earliest entry
+static struct arena_t schedule_arena; // owns the commands parsed for one run
+
+/**
+ * Move a heap entry up or down until the heap is ordered again
+ * @param i [description]
+ */
+void schedule_fix(int i)
+{
+    while (i > 0 && schedule_heap[(i - 1) / 2]->due > schedule_heap[i]->due)
+    {
+        struct schedule_entry_t *swap = schedule_heap[i];
+        schedule_heap[i] = schedule_heap[(i - 1) / 2];
+        schedule_heap[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+    while (1)
+    {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2; child++)
+            if (child < schedule_count && schedule_heap[child]->due < schedule_heap[smallest]->due)
+                smallest = child;
+        if (smallest == i)
+            return;
+        struct schedule_entry_t *swap = schedule_heap[i];
+        schedule_heap[i] = schedule_heap[smallest];
+        schedule_heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/**
+ * Take an entry out of the heap
+ * @param  i [description]
+ * @return   the entry
+ */
+struct schedule_entry_t *schedule_remove(int i)
+{
+    struct schedule_entry_t *entry = schedule_heap[i];
+    schedule_heap[i] = schedule_heap[--schedule_count];
+    if (i < schedule_count)
+        schedule_fix(i);
+    return entry;
+}
+
+/**
+ * Arm the timerfd for the earliest entry, or disarm it when there is none
+ */
+void schedule_arm()
+{
+    struct itimerspec when = {{0, 0}, {0, 0}};
+    if (schedule_count > 0)
+    {
+        uint64_t due = schedule_heap[0]->due ? schedule_heap[0]->due : 1; // zero would disarm
+        when.it_value.tv_sec = due / 1000000000;
+        when.it_value.tv_nsec = due % 1000000000;
+    }
+    timerfd_settime(schedule_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/**
+ * Add a command to the scheduler
+ * @param  text   command line
+ * @param  delay  nanoseconds until the first run
+ * @param  period nanoseconds between runs, 0 to run once
+ * @return        id of the entry, -1 if the scheduler is full
+ */
+int schedule_add(const char *text, uint64_t delay, uint64_t period)
+{
+    if (schedule_fd == -1)
+        schedule_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (schedule_fd == -1 || schedule_count == MAX_SCHEDULED)
+        return -1;
+    struct schedule_entry_t *entry = malloc(sizeof(struct schedule_entry_t));
+    entry->id = schedule_next_id++;
+    entry->due = monotonic_ns() + delay;
+    entry->period = period;
+    entry->text = strdup(text);
+    schedule_heap[schedule_count++] = entry;
+    schedule_fix(schedule_count - 1);
+    schedule_arm();
+    return entry->id;
+}
+
+/**
+ * Drop the scheduled commands that have finished from the job table; they
+ * are not reported like the jobs the user started
+ */
+void reap_scheduled_jobs()
+{
+    block_sigchld(SIG_BLOCK);
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (jobs[i].id != 0 && jobs[i].scheduled && job_state(&jobs[i]) == JOB_DONE)
+            remove_job(&jobs[i]);
+    block_sigchld(SIG_UNBLOCK);
+}
+
+/**
+ * Run the command of a scheduler entry. At the prompt it goes to the
+ * background so that it cannot hold up the user; in a script it runs in
+ * line like any other command. $? is left alone.
+ * @param text [description]
+ */
+void schedule_run(const char *text)
+{
+    int status = last_status;
+    char *line = arena_alloc(&schedule_arena, strlen(text) + 1);
+    strcpy(line, text);
+    struct command_t *command = arena_calloc(&schedule_arena, sizeof(struct command_t));
+    if (parse_command(line, command, &schedule_arena) == 0 && strcmp(command->name, "exit") != 0)
+    {
+        for (struct command_t *pipeline = command; pipeline != NULL; pipeline = pipeline->chain)
+        {
+            pipeline->background = pipeline->background || shell_interactive;
+            for (struct command_t *stage = pipeline; stage != NULL; stage = stage->next)
+                stage->scheduled = true;
+        }
+        process_command(command);
+    }
+    arena_reset(&schedule_arena);
+    last_status = status;
+}
+
+/**
+ * Run every entry that is due, then rearm the timer. Periodic entries are
+ * put back for their next run; runs missed while the shell was busy are
+ * skipped rather than run in a burst.
+ */
+void schedule_run_due()
+{
+    uint64_t expirations;
+    if (schedule_fd == -1)
+        return;
+    read(schedule_fd, &expirations, sizeof(expirations));
+    reap_scheduled_jobs();
+
+    uint64_t now = monotonic_ns();
+    while (schedule_count > 0 && schedule_heap[0]->due <= now)
+    {
+        struct schedule_entry_t *entry = schedule_remove(0);
+        schedule_run(entry->text);
+        if (entry->period == 0)
+        {
+            free(entry->text);
+            free(entry);
+            continue;
+        }
+        while (entry->due <= now)
+            entry->due += entry->period;
+        schedule_heap[schedule_count++] = entry;
+        schedule_fix(schedule_count - 1);
+    }
+    schedule_arm();
+}
+
+/**
+ * Run the entries that are due when there is no prompt to wait at
+ * @param wait keep running entries until none are left
+ */
+void schedule_poll(bool wait)
+{
+    while (schedule_count > 0)
+    {
+        struct pollfd fds = {.fd = schedule_fd, .events = POLLIN};
+        if (poll(&fds, 1, wait ? -1 : 0) == 1)
+            schedule_run_due();
+        else if (!wait)
+            return;
+    }
+}
+
+/**
+ * Read a key at the prompt, running scheduled commands that come due while
+ * the shell waits for it
+ * @return [description]
+ */
+int prompt_getchar()
+{
+    while (schedule_count > 0)
+    {
+        struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = schedule_fd, .events = POLLIN}};
+        if (poll(fds, 2, -1) == -1 && errno != EINTR)
+            break;
+        if (fds[1].revents & POLLIN)
+            schedule_run_due();
+        if (fds[0].revents)
+            break;
+    }
+    return getchar();
+}
+
+/**
+ * Parse a duration in seconds, fractions allowed
+ * @param  text [description]
+ * @param  ns   set to the duration in nanoseconds
+ * @return      0, -1 if text is not a duration
+ */
+int parse_seconds(const char *text, uint64_t *ns)
+{
+    char *end;
+    double seconds = strtod(text, &end);
+    if (end == text || *end != '\0' || seconds < 0 || seconds > 1e9)
+        return -1;
+    *ns = (uint64_t)(seconds * 1e9);
+    return 0;
+}
+
+/**
+ * Find a builtin in a command line that acts on the shell itself (cd,
+ * kill, fg...). Those always run in the shell process, so scheduled they
+ * would change its state while the user is typing, outside of any job.
+ * @param  text command line
+ * @return      its name, NULL if there is none or text does not parse
+ */
+const char *schedule_shell_builtin(const char *text)
+{
+    struct arena_t arena;
+    memset(&arena, 0, sizeof(arena));
+    char *line = arena_alloc(&arena, strlen(text) + 1);
+    strcpy(line, text);
+    struct command_t *command = arena_calloc(&arena, sizeof(struct command_t));
+    const char *found = NULL;
+    if (parse_command(line, command, &arena) == 0)
+    {
+        for (struct command_t *pipeline = command; pipeline != NULL && found == NULL; pipeline = pipeline->chain)
+        {
+            for (struct command_t *stage = pipeline; stage != NULL && found == NULL; stage = stage->next)
+            {
+                const struct builtin_t *builtin = find_builtin(stage->name);
+                if (builtin != NULL && (builtin->flags & BUILTIN_PIPELINE) == 0)
+                    found = builtin->name;
+            }
+        }
+    }
+    arena_destroy(&arena);
+    return found;
+}
+
+/**
+ * The schedule builtin:
+ *   schedule <seconds> <command...>      run the command once after a delay
+ *   schedule -r <seconds> <command...>   run it every so many seconds
+ *   schedule list                        show what is scheduled
+ *   schedule cancel <id>|all             remove entries
+ * A command with pipes or redirections is passed as one quoted argument.
+ * Builtins that act on the shell itself cannot be scheduled.
+ * @param  command [description]
+ * @return         [description]
+ */
+int schedule_builtin(struct command_t *command)
+{
+    char **args = command->args;
+    int arg_count = command->arg_count;
+    if (arg_count == 0 || strcmp(args[0], "list") == 0)
+    {
+        uint64_t now = monotonic_ns();
+        for (int i = 0; i < schedule_count; i++)
+        {
+            struct schedule_entry_t *entry = schedule_heap[i];
+            printf("%4d  in %8.3fs", entry->id, entry->due > now ? (entry->due - now) / 1e9 : 0.0);
+            if (entry->period)
+                printf("  every %.3fs", entry->period / 1e9);
+            printf("  %s\n", entry->text);
+        }
+        return SUCCESS;
+    }
+
+    if (strcmp(args[0], "cancel") == 0)
+    {
+        if (arg_count < 2)
+        {
+            printf("-%s: schedule: cancel needs an id or all\n", sysname);
+            last_status = 2;
+            return SUCCESS;
+        }
+        bool all = strcmp(args[1], "all") == 0;
+        int id = atoi(args[1]), cancelled = 0;
+        for (int i = schedule_count - 1; i >= 0; i--)
+        {
+            if (!all && schedule_heap[i]->id != id)
+                continue;
+            struct schedule_entry_t *entry = schedule_remove(i);
+            free(entry->text);
+            free(entry);
+            cancelled++;
+        }
+        if (cancelled == 0)
+        {
+            printf("-%s: schedule: %s: no such entry\n", sysname, args[1]);
+            last_status = 1;
+        }
+        schedule_arm();
+        return SUCCESS;
+    }
+
+    bool repeat = strcmp(args[0], "-r") == 0 || strcmp(args[0], "--every") == 0;
+    if (repeat)
+    {
+        args++;
+        arg_count--;
+    }
+    uint64_t delay;
+    if (arg_count < 2 || parse_seconds(args[0], &delay) == -1 || (repeat && delay == 0))
+    {
+        printf("Usage: schedule [-r] <seconds> <command...> | schedule list | schedule cancel <id>|all\n");
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    char text[4096];
+    int len = 0;
+    for (int i = 1; i < arg_count && len < (int)sizeof(text); i++)
+        len += snprintf(text + len, sizeof(text) - len, i > 1 ? " %s" : "%s", args[i]);
+    const char *builtin = schedule_shell_builtin(text);
+    if (builtin != NULL)
+    {
+        printf("-%s: schedule: %s runs in the shell and cannot be scheduled\n", sysname, builtin);
+        last_status = 2;
+        return SUCCESS;
+    }
+    int id = schedule_add(text, delay, repeat ? delay : 0);
+    if (id == -1)
+    {
+        printf("-%s: schedule: too many scheduled commands\n", sysname);
+        last_status = 1;
+    }
+    else if (shell_interactive)
+        printf("[scheduled %d]\n", id);
+    return SUCCESS;
+}
+
+/**
+ * Whether a stage is run by the shell itself and so needs a forked child
+ * @param  name [description]
+ * @return      [description]
+ */
+bool is_stage_builtin(const char *name)
+{
+    return find_builtin(name) != NULL;
+}
+
+/**
+ * Build the argument vector for exec: the name first and a NULL at the end
+ * @param  command [description]
+ * @return         malloc'd array sharing the strings of command
+ */
+char **build_argv(struct command_t *command)
+{
+    char **argv = malloc(sizeof(char *) * (command->arg_count + 2));
+    argv[0] = command->name;
+    for (int i = 0; i < command->arg_count; i++)
+        argv[i + 1] = command->args[i];
+    argv[command->arg_count + 1] = NULL;
+    return argv;
+}
+
+/**
+ * Launch an external pipeline stage with posix_spawn(), which glibc runs on
+ * clone(CLONE_VM | CLONE_VFORK) and so never copies the page tables of the
+ * shell. The pipe ends and redirections become spawn file actions.
+ * @param  stage      [description]
+ * @param  path       resolved program to run
+ * @param  pgid       process group to join, 0 to start a new one
+ * @param  prev_read  read end of the pipe from the previous stage, or -1
+ * @param  p          pipe to the next stage, {-1, -1} for the last stage
+ * @param  foreground hand the terminal to the new process group
+ * @return            pid of the stage, -1 on error
+ */
+pid_t spawn_stage(struct command_t *stage, const char *path, pid_t pgid, int prev_read, int p[2], bool foreground)
+{
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+
+    // same process group and signal dispositions as a forked stage would set up
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGTTIN);
+    sigaddset(&mask, SIGTTOU);
+    sigaddset(&mask, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF);
+#ifdef HAVE_SPAWN_TCSETPGRP
+    if (foreground)
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+
+    if (prev_read != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, prev_read, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, prev_read);
+    }
+    if (p[1] != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, p[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, p[0]);
+        posix_spawn_file_actions_addclose(&actions, p[1]);
+    }
+    if (stage->redirects[0] != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, stage->redirects[0], O_RDONLY, 0);
+    if (stage->redirects[1] != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, stage->redirects[1],
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stage->redirects[2] != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, stage->redirects[2],
+                                         O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (stage->redirects[3] != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, stage->redirects[3],
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stage->redirects[4] != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, stage->redirects[4],
+                                         O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (stage->stderr_to_stdout)
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    char **argv = build_argv(stage);
+    extern char **environ;
+    pid_t pid;
+    int error = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    free(argv);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (error != 0)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, stage->name, strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Check that a parsed command list is well formed
+ * @param  command [description]
+ * @return         [description]
+ */
+bool command_is_sane(struct command_t *command)
+{
+    for (struct command_t *pipeline = command; pipeline != NULL; pipeline = pipeline->chain)
+    {
+        for (struct command_t *stage = pipeline; stage != NULL; stage = stage->next)
+        {
+            if (stage->name == NULL || stage->arg_count < 0 || (stage->arg_count > 0 && stage->args == NULL))
+                return false;
+            for (int i = 0; i < stage->arg_count; i++)
+                if (stage->args[i] == NULL)
+                    return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * "bench parse [count] [bytes]": parse a generated command line of about
+ * bytes characters count times and print the parse rate
+ * @param  command [description]
+ * @return         [description]
+ */
+int bench_parse(struct command_t *command)
+{
+    int count = command->arg_count > 1 ? atoi(command->args[1]) : 10000;
+    int bytes = command->arg_count > 2 ? atoi(command->args[2]) : 4096;
+    const char *segment = "cmd --flag=value \"quoted arg with spaces\" 'single quoted' esc\\ aped "
+                          ">out.txt 2>&1 | filter -x <in.txt && next \"a\\\"b\" ; ";
+    size_t seglen = strlen(segment);
+    if (count <= 0 || bytes <= 0)
+        return SUCCESS;
+
+    char *line = malloc(bytes + seglen + 16);
+    size_t len = 0;
+    while (len < (size_t)bytes)
+    {
+        memcpy(line + len, segment, seglen);
+        len += seglen;
+    }
+    memcpy(line + len, "last", 5);
+    len += 4;
+    char *copy = malloc(len + 1);
+    struct arena_t arena;
+    memset(&arena, 0, sizeof(arena));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(copy, line, len + 1); // parse_command trims its input in place
+        struct command_t *parsed = arena_calloc(&arena, sizeof(struct command_t));
+        parse_command(copy, parsed, &arena);
+        arena_reset(&arena);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("parse %d lines of %zu bytes in %.3f s: %.0f lines/s, %.1f MB/s, %ld allocations per line\n",
+           count, len, seconds, count / seconds, count * (double)len / seconds / 1e6,
+           arena.total_allocations / count);
+    arena_destroy(&arena);
+    free(copy);
+    free(line);
+    return SUCCESS;
+}
+
+/**
+ * "bench fuzz [iterations] [seed]": parse random lines made of quotes,
+ * operators and escapes, and check every result is well formed
+ * @param  command [description]
+ * @return         [description]
+ */
+int bench_fuzz(struct command_t *command)
+{
+    int iterations = command->arg_count > 1 ? atoi(command->args[1]) : 100000;
+    unsigned int seed = command->arg_count > 2 ? (unsigned int)atoi(command->args[2]) : (unsigned int)time(NULL);
+    const char alphabet[] = "ab  |&;<>2'\"\\\t?1-";
+    char line[129];
+    int parsed_ok = 0, rejected = 0, broken = 0;
+
+    struct arena_t arena;
+    memset(&arena, 0, sizeof(arena));
+    srand(seed);
+    parse_quiet = true;
+    for (int i = 0; i < iterations; i++)
+    {
+        int len = rand() % (sizeof(line) - 1);
+        for (int k = 0; k < len; k++)
+            line[k] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        line[len] = '\0';
+
+        struct command_t *parsed = arena_calloc(&arena, sizeof(struct command_t));
+        if (parse_command(line, parsed, &arena) == -1)
+            rejected++;
+        else if (command_is_sane(parsed))
+            parsed_ok++;
+        else
+            broken++;
+        arena_reset(&arena);
+    }
+    arena_destroy(&arena);
+    parse_quiet = false;
+    printf("fuzz seed %u: %d lines parsed, %d rejected as syntax errors, %d malformed\n", seed,
+           parsed_ok, rejected, broken);
+    last_status = broken > 0;
+    return SUCCESS;
+}
+
+#ifdef SHELLAX_FUZZ
+/**
+ * libFuzzer entry point for the parser, built with
+ * clang -DSHELLAX_FUZZ -fsanitize=fuzzer,address shellax-skeleton.c
+ */
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    char *line = malloc(size + 1);
+    memcpy(line, data, size);
+    line[size] = '\0';
+    parse_quiet = true;
+    struct command_t *parsed = arena_calloc(&command_arena, sizeof(struct command_t));
+    if (parse_command(line, parsed, &command_arena) == 0 && !command_is_sane(parsed))
+        abort();
+    arena_reset(&command_arena);
+    free(line);
+    return 0;
+}
+#endif
+
+/**
+ * The bench builtin: "bench spawn [count] [command args...]" runs a command
+ * count times through the posix_spawn fast path and through fork, and prints
+ * the launch rate of each; "bench parse" and "bench fuzz" exercise the parser
+ * @param  command [description]
+ * @return         [description]
+ */
+int bench_builtin(struct command_t *command)
+{
+    if (command->arg_count > 0 && strcmp(command->args[0], "parse") == 0)
+        return bench_parse(command);
+    if (command->arg_count > 0 && strcmp(command->args[0], "fuzz") == 0)
+        return bench_fuzz(command);
+    if (command->arg_count < 1 || strcmp(command->args[0], "spawn") != 0)
+    {
+        printf("usage: bench spawn [count] [command args...]\n"
+               "       bench parse [count] [bytes]\n"
+               "       bench fuzz [iterations] [seed]\n");
+        return SUCCESS;
+    }
+
+    int count = command->arg_count > 1 ? atoi(command->args[1]) : 1000;
+    struct command_t target;
+    memset(&target, 0, sizeof(target));
+    target.name = command->arg_count > 2 ? command->args[2] : "true";
+    target.args = command->args + 3;
+    target.arg_count = command->arg_count > 3 ? command->arg_count - 3 : 0;
+    if (count <= 0 || lookup_command(target.name) == NULL)
+    {
+        printf("-%s: bench: nothing to run\n", sysname);
+        return SUCCESS;
+    }
+
+    init_jobs(); // as a pipeline stage, the child's SIGCHLD was reset, and run_pipeline waits on the handler
+    const char *modes[] = {"spawn", "fork"};
+    for (int mode = 0; mode < 2; mode++)
+    {
+        struct timespec start, end;
+        use_spawn = mode == 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < count; i++)
+            run_pipeline(&target);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-5s %d commands in %.3f s: %.0f commands/s, %.1f us each\n", modes[mode],
+               count, seconds, count / seconds, seconds * 1e6 / count);
+    }
+    use_spawn = true;
+    return SUCCESS;
+}
+
+/**
+ * Run a pipeline: one pipe per stage boundary, every stage forked up front
+ * into a single process group so they all run concurrently, then every stage
+ * is tracked in the job table. Also used for a lone command, which is a one stage pipeline.
+ * @param  command first stage
+ * @return         [description]
+ */
+int run_pipeline(struct command_t *command)
+{
+    int stages = 0;
+    for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+        stages++;
+
+    pid_t *pids = malloc(sizeof(pid_t) * stages);
+    pid_t pgid = 0;
+    int prev_read = -1; // read end of the pipe feeding the current stage
+    int i = 0;
+    bool aborted = false; // a stage could not be forked
+    for (int k = 0; k < stages; k++)
+        pids[k] = -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    block_sigchld(SIG_BLOCK); // no stage may be reaped before its job exists
+    fflush(stdout); // do not let the children inherit pending prompt output
+    for (struct command_t *stage = command; stage != NULL; stage = stage->next, i++)
+    {
+        int p[2] = {-1, -1};
+        if (stage->next != NULL && pipe(p) == -1)
+        {
+            printf("-%s: pipe: %s\n", sysname, strerror(errno));
+            aborted = true;
+            break;
+        }
+
+        // external commands take the posix_spawn fast path; builtins, and a
+        // foreground job when the terminal cannot be handed over, need fork
+        bool foreground = shell_interactive && !command->background;
+        char *path = is_stage_builtin(stage->name) ? NULL : lookup_command(stage->name);
+        pid_t pid = -2;
+#ifndef HAVE_SPAWN_TCSETPGRP
+        if (!foreground)
+#endif
+            if (use_spawn && path != NULL && stage->fanout == NULL)
+                pid = spawn_stage(stage, path, pgid, prev_read, p, foreground && pgid == 0);
+
+        if (pid == -2 && (pid = fork()) == -1)
+        {
+            // stop here: the stages already running are killed and reaped below
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "-%s: fork", sysname);
+            perror(prefix);
+            if (p[0] != -1)
+            {
+                close(p[0]);
+                close(p[1]);
+            }
+            aborted = true;
+            break;
+        }
+        if (pid == 0) // child process
+        {
+            setpgid(0, pgid);
+            if (shell_interactive && !command->background)
+                tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid());
+            if (prev_read != -1)
+            {
+                dup2(prev_read, STDIN_FILENO); // read the output of the previous stage
+                close(prev_read);
+            }
+            if (p[1] != -1)
+            {
+                dup2(p[1], STDOUT_FILENO); // write to the next stage
+                close(p[0]);
+                close(p[1]);
+            }
+            exec_stage(stage);
+        }
+
+        if (pid != -1)
+        {
+            // set the group from the parent too, so it exists whichever runs first
+            if (pgid == 0)
+                pgid = pid;
+            setpgid(pid, pgid);
+        }
+        pids[i] = pid;
+        if (prev_read != -1)
+            close(prev_read);
+        if (p[1] != -1)
+            close(p[1]);
+        prev_read = p[0];
+    }
+    if (prev_read != -1)
+        close(prev_read);
+
+    if (aborted)
+    {
+        last_status = 1;
+        if (pgid == 0) // nothing was started
+        {
+            free(pids);
+            block_sigchld(SIG_UNBLOCK);
+            return SUCCESS;
+        }
+        kill(-pgid, SIGTERM);
+        kill(-pgid, SIGCONT);
+        stages = i; // only the stages that were started make up the job, which is waited for
+        command->background = false;
+    }
+
+    struct job_t *job = add_job(command, pgid, pids, stages, start);
+    free(pids);
+    if (job == NULL)
+    {
+        printf("-%s: too many jobs\n", sysname);
+        block_sigchld(SIG_UNBLOCK);
+        return SUCCESS;
+    }
+
+    if (command->background)
+    {
+        if (!command->scheduled)
+        {
+            current_job = job->id;
+            if (shell_interactive) // scripts print only what their commands print
+                printf("[%d] %d\n", job->id, pgid);
+        }
+        block_sigchld(SIG_UNBLOCK);
+    }
+    else
+    {
+        if (shell_interactive && pgid != 0)
+            tcsetpgrp(STDIN_FILENO, pgid);
+        block_sigchld(SIG_UNBLOCK);
+        wait_for_job(job);
+        if (aborted)
+            last_status = 1;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Run one stage of a pipeline in a forked child. Builtins run here directly;
+ * anything else is exec'd. Never returns.
+ * @param command [description]
+ */
+void exec_stage(struct command_t *command)
+{
+    // undo the signal dispositions of the interactive shell
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    block_sigchld(SIG_UNBLOCK);
+
+    // an explicit redirection overrides the pipe; uniq maps its "<" file itself
+    const struct builtin_t *builtin = find_builtin(command->name);
+    if (((builtin == NULL || (builtin->flags & BUILTIN_OWN_INPUT) == 0) && redirect_input(command) == -1) ||
+        redirect_output(command) == -1 || fan_out(command) == -1)
+        exit(1);
+
+    if (builtin != NULL) // builtins run without exec
+    {
+        builtin->handler(command);
+        fflush(stdout);
+        exit(last_status);
+    }
+
+    // resolve the command through the hashed PATH cache instead of scanning every directory
+    char *pathOfCommand = lookup_command(command->name);
+    if (pathOfCommand != NULL)
+        execv(pathOfCommand, build_argv(command)); // give the path of the command and the arguments to execv()
+    fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+    exit(127); // never fall back into the shell loop from the child
+}
+
+#define HASH_TABLE_SIZE 256 // buckets of the command location cache
+#define MAX_PATH_DIRS 64    // PATH entries beyond this are ignored
+
+struct path_dir_t
+{
+    char *path;
+    struct timespec mtime; // modification time when the directory was last checked
+    int watch;             // inotify watch on the directory, -1 if it is checked by mtime
+};
+
+struct hash_entry_t
+{
+    char *name;
+    char *path;    // full path handed to execv(), NULL for a command that is not in PATH
+    int dir_index; // index of the PATH directory the command was found in, path_dir_count for a miss
+    int hits;      // number of times the cached location was used
+    struct hash_entry_t *next;
+};
+
+static char *hashed_path = NULL; // the PATH value path_dirs was built from
+static struct path_dir_t path_dirs[MAX_PATH_DIRS];
+static int path_dir_count = 0;
+static int path_inotify = -1; // reports changes to the watched PATH directories
+static struct hash_entry_t *command_hash[HASH_TABLE_SIZE];
+static bool command_trie_stale = true; // set when PATH or a PATH directory changes
+
+/**
+ * FNV-1a hash of a string
+ * @param  s [description]
+ * @return   [description]
+ */
+unsigned long hash_string(const char *s)
+{
+    unsigned long h = 14695981039346656037UL;
+    for (; *s; s++)
+    {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/**
+ * Drop cached locations found in PATH directory first_dir or later
+ * @param first_dir [description]
+ */
+void hash_drop_from(int first_dir)
+{
+    for (int i = 0; i < HASH_TABLE_SIZE; i++)
+    {
+        struct hash_entry_t **link = &command_hash[i];
+        while (*link != NULL)
+        {
+            struct hash_entry_t *entry = *link;
+            if (entry->dir_index >= first_dir)
+            {
+                *link = entry->next;
+                free(entry->name);
+                free(entry->path);
+                free(entry);
+            }
+            else
+                link = &entry->next;
+        }
+    }
+}
+
+/**
+ * Forget every cached command location (hash -r)
+ */
+void hash_clear()
+{
+    hash_drop_from(0);
+}
+
+/**
+ * Bring the PATH directory table up to date. A changed PATH flushes the whole
+ * cache; a directory that changed invalidates the entries found in it and in
+ * every later directory, since a new file there may now shadow them, and
+ * every cached miss. Directories are watched with inotify, so an unchanged
+ * PATH costs one read() rather than a stat() per directory; only those that
+ * cannot be watched (one that does not exist yet, say) are checked by mtime.
+ */
+void hash_refresh_path()
+{
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "";
+
+    if (hashed_path == NULL || strcmp(hashed_path, path) != 0)
+    {
+        hash_clear();
+        for (int i = 0; i < path_dir_count; i++)
+            free(path_dirs[i].path);
+        path_dir_count = 0;
+        free(hashed_path);
+        hashed_path = strdup(path);
+        command_trie_stale = true;
+
+        if (path_inotify != -1)
+            close(path_inotify);
+        path_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        const char *start = path;
+        while (path_dir_count < MAX_PATH_DIRS)
+        {
+            const char *end = strchr(start, ':');
+            size_t len = end ? (size_t)(end - start) : strlen(start);
+            // an empty PATH entry means the current directory
+            struct path_dir_t *dir = &path_dirs[path_dir_count++];
+            dir->path = len ? strndup(start, len) : strdup(".");
+            memset(&dir->mtime, 0, sizeof(struct timespec));
+            // a relative entry names a different directory after cd, so it is checked by mtime
+            dir->watch = path_inotify == -1 || dir->path[0] != '/' ? -1
+                                            : inotify_add_watch(path_inotify, dir->path,
+                                                                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                                                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+            if (end == NULL)
+                break;
+            start = end + 1;
+        }
+    }
+
+    int changed = path_dir_count; // first directory that changed
+    if (path_inotify != -1)
+    {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while ((n = read(path_inotify, buf, sizeof(buf))) > 0)
+        {
+            for (char *pos = buf; pos < buf + n; pos += sizeof(struct inotify_event) + ((struct inotify_event *)pos)->len)
+            {
+                struct inotify_event *event = (struct inotify_event *)pos;
+                if (event->mask & IN_Q_OVERFLOW)
+                    changed = 0;
+                for (int i = 0; i < path_dir_count; i++)
+                {
+                    if (path_dirs[i].watch != event->wd)
+                        continue;
+                    if (i < changed)
+                        changed = i;
+                    if (event->mask & IN_IGNORED) // the directory went away, check it by mtime from now on
+                        path_dirs[i].watch = -1;
+                }
+            }
+        }
+    }
+
+    struct stat st;
+    for (int i = 0; i < path_dir_count; i++)
+    {
+        if (path_dirs[i].watch != -1)
+            continue;
+        if (stat(path_dirs[i].path, &st) == -1)
+            memset(&st.st_mtim, 0, sizeof(struct timespec));
+        if (st.st_mtim.tv_sec != path_dirs[i].mtime.tv_sec ||
+            st.st_mtim.tv_nsec != path_dirs[i].mtime.tv_nsec)
+        {
+            path_dirs[i].mtime = st.st_mtim;
+            if (i < changed)
+                changed = i;
+        }
+    }
+    if (changed < path_dir_count)
+    {
+        hash_drop_from(changed);
+        command_trie_stale = true;
+    }
+}
+
+/**
+ * Resolve a command name to the path to execute. Names containing a slash
+ * (./prog, /bin/ls) are used as they are; anything else is looked up in the
+ * cache and, on a miss, probed with one stat() per PATH directory.
+ * @param  name [description]
+ * @return      path to pass to execv(), NULL if not found
+ */
+char *lookup_command(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+        return (char *)name;
+    if (hashed_path == NULL)
+        hash_refresh_path();
+
+    unsigned long bucket = hash_string(name) % HASH_TABLE_SIZE;
+    for (struct hash_entry_t *entry = command_hash[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            if (entry->path != NULL)
+                entry->hits++;
+            return entry->path;
+        }
+    }
+
+    char candidate[PATH_MAX];
+    struct stat st;
+    for (int i = 0; i < path_dir_count; i++)
+    {
+        if (snprintf(candidate, sizeof(candidate), "%s/%s", path_dirs[i].path, name) >= (int)sizeof(candidate))
+            continue;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+        {
+            struct hash_entry_t *entry = malloc(sizeof(struct hash_entry_t));
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            entry->dir_index = i;
+            entry->hits = 1;
+            entry->next = command_hash[bucket];
+            command_hash[bucket] = entry;
+            return entry->path;
+        }
+    }
+
+    // remember the miss too, until any PATH directory changes
+    struct hash_entry_t *entry = malloc(sizeof(struct hash_entry_t));
+    entry->name = strdup(name);
+    entry->path = NULL;
+    entry->dir_index = path_dir_count;
+    entry->hits = 0;
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    return NULL;
+}
+
+/**
+ * The hash builtin: "hash" lists the cache, "hash -r" empties it and
+ * "hash name..." looks the names up and remembers them.
+ * @param  command [description]
+ * @return         [description]
+ */
+int hash_builtin(struct command_t *command)
+{
+    if (command->arg_count == 0)
+    {
+        int shown = 0;
+        for (int i = 0; i < HASH_TABLE_SIZE; i++)
+        {
+            for (struct hash_entry_t *entry = command_hash[i]; entry != NULL; entry = entry->next)
+            {
+                if (entry->path == NULL)
+                    continue;
+                if (shown++ == 0)
+                    printf("hits\tcommand\n");
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (shown == 0)
+            printf("%s: hash table empty\n", sysname);
+        return SUCCESS;
+    }
+
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        if (strcmp(command->args[i], "-r") == 0)
+        {
+            hash_clear();
+            continue;
+        }
+        if (strchr(command->args[i], '/') != NULL)
+            continue; // paths are never hashed
+        if (lookup_command(command->args[i]) == NULL)
+            printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+    }
+    return SUCCESS;
+}
+
+#define DIR_CACHE_SIZE 16          // directory listings kept for filename completion
+#define COMPLETION_ASK_LIMIT 100   // ask before listing more candidates than this
+
+struct trie_node_t
+{
+    char c;
+    bool terminal;              // a complete name ends here
+    struct trie_node_t *child;  // first child, children are kept sorted
+    struct trie_node_t *sibling;
+};
+
+struct dir_listing_t
+{
+    char *path;
+    struct timespec mtime; // modification time when the directory was read
+    char **names;          // sorted, directories end with '/'
+    int count;
+    unsigned long used;    // completion count at the last use, for eviction
+};
+
+static struct arena_t trie_arena;                // owns every node of the command trie
+static struct trie_node_t command_trie;          // root, built by build_command_trie()
+static struct dir_listing_t dir_cache[DIR_CACHE_SIZE];
+static unsigned long completions = 0;
+
+/**
+ * Insert a name into a trie, keeping every level sorted
+ * @param root [description]
+ * @param name [description]
+ */
+void trie_insert(struct trie_node_t *root, const char *name)
+{
+    struct trie_node_t *node = root;
+    for (; *name; name++)
+    {
+        struct trie_node_t **link = &node->child;
+        while (*link != NULL && (*link)->c < *name)
+            link = &(*link)->sibling;
+        if (*link == NULL || (*link)->c != *name)
+        {
+            struct trie_node_t *child = arena_calloc(&trie_arena, sizeof(struct trie_node_t));
+            child->c = *name;
+            child->sibling = *link;
+            *link = child;
+        }
+        node = *link;
+    }
+    node->terminal = true;
+}
+
+/**
+ * Rebuild the command trie from the builtins and every executable in PATH.
+ * This reads each PATH directory once; it only runs again after
+ * hash_refresh_path() notices that PATH or one of its directories changed.
+ */
+void build_command_trie()
+{
+    arena_reset(&trie_arena);
+    memset(&command_trie, 0, sizeof(command_trie));
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        if (builtins[i].name != NULL)
+            trie_insert(&command_trie, builtins[i].name);
+
+    for (int i = 0; i < path_dir_count; i++)
+    {
+        DIR *dir = opendir(path_dirs[i].path);
+        if (dir == NULL)
+            continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+                continue;
+            if (faccessat(dirfd(dir), entry->d_name, X_OK, 0) == 0)
+                trie_insert(&command_trie, entry->d_name);
+        }
+        closedir(dir);
+    }
+    command_trie_stale = false;
+}
+
+/**
+ * Collect the names below a trie node, in sorted order
+ * @param node   [description]
+ * @param name   the name spelled by the path to node, extended in place
+ * @param len    [description]
+ * @param out    NULL to only count the names
+ * @param count  [description]
+ */
+void trie_collect(struct trie_node_t *node, char *name, int len, char ***out, int *count)
+{
+    if (node->terminal)
+    {
+        if (out != NULL)
+        {
+            *out = realloc(*out, sizeof(char *) * (*count + 1));
+            (*out)[*count] = strndup(name, len);
+        }
+        (*count)++;
+    }
+    if (len >= PATH_MAX - 1)
+        return;
+    for (struct trie_node_t *child = node->child; child != NULL; child = child->sibling)
+    {
+        name[len] = child->c;
+        trie_collect(child, name, len + 1, out, count);
+    }
+}
+
+/**
+ * Complete a command name. The characters every match shares after prefix
+ * are written to extension.
+ * @param  prefix    [description]
+ * @param  extension [description]
+ * @param  size      [description]
+ * @param  list      when not NULL, receives the matching names
+ * @param  count     [description]
+ * @return           number of matches
+ */
+int complete_command(const char *prefix, char *extension, size_t size, char ***list, int *count)
+{
+    hash_refresh_path();
+    if (command_trie_stale)
+        build_command_trie();
+
+    struct trie_node_t *node = &command_trie;
+    for (const char *p = prefix; *p && node != NULL; p++)
+    {
+        node = node->child;
+        while (node != NULL && node->c != *p)
+            node = node->sibling;
+    }
+    extension[0] = '\0';
+    if (node == NULL)
+        return 0;
+
+    // the common extension runs down while there is no choice to make
+    size_t len = 0;
+    struct trie_node_t *common = node;
+    while (!common->terminal && common->child != NULL && common->child->sibling == NULL && len + 1 < size)
+    {
+        common = common->child;
+        extension[len++] = common->c;
+    }
+    extension[len] = '\0';
+
+    char name[PATH_MAX];
+    int matches = 0;
+    snprintf(name, sizeof(name), "%s", prefix);
+    if (list != NULL)
+        *list = NULL;
+    trie_collect(node, name, strlen(name), list, &matches);
+    if (count != NULL)
+        *count = matches;
+    return matches;
+}
+
+/**
+ * Compare two strings through pointers, for qsort
+ * @param  a [description]
+ * @param  b [description]
+ * @return   [description]
+ */
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * The sorted listing of a directory, read again only when the directory's
+ * mtime has changed since it was cached
+ * @param  path [description]
+ * @return      NULL if the directory cannot be read
+ */
+struct dir_listing_t *read_dir_listing(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    struct dir_listing_t *slot = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        struct dir_listing_t *listing = &dir_cache[i];
+        if (listing->path != NULL && strcmp(listing->path, path) == 0)
+        {
+            slot = listing;
+            break;
+        }
+        if (listing->path == NULL || listing->used < slot->used)
+            slot = listing; // free or least recently used
+    }
+    slot->used = ++completions;
+    if (slot->path != NULL && strcmp(slot->path, path) == 0 && slot->mtime.tv_sec == st.st_mtim.tv_sec &&
+        slot->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return slot;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return NULL;
+    for (int i = 0; i < slot->count; i++)
+        free(slot->names[i]);
+    free(slot->names);
+    free(slot->path);
+    slot->path = strdup(path);
+    slot->mtime = st.st_mtim;
+    slot->names = NULL;
+    slot->count = 0;
+
+    int capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        bool is_dir = entry->d_type == DT_DIR;
+        struct stat entry_st;
+        if ((entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) &&
+            fstatat(dirfd(dir), entry->d_name, &entry_st, 0) == 0)
+            is_dir = S_ISDIR(entry_st.st_mode);
+        if (slot->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            slot->names = realloc(slot->names, sizeof(char *) * capacity);
+        }
+        size_t len = strlen(entry->d_name);
+        char *name = malloc(len + 2);
+        memcpy(name, entry->d_name, len);
+        strcpy(name + len, is_dir ? "/" : "");
+        slot->names[slot->count++] = name;
+    }
+    closedir(dir);
+    qsort(slot->names, slot->count, sizeof(char *), compare_names);
+    return slot;
+}
+
+/**
+ * Complete a file name. Matches are found by binary search in the cached,
+ * sorted listing of the directory part of word.
+ * @param  word      [description]
+ * @param  extension receives the characters every match shares after word
+ * @param  size      [description]
+ * @param  list      when not NULL, receives the matching names
+ * @param  count     receives the number of matches
+ * @return           number of matches
+ */
+int complete_file(const char *word, char *extension, size_t size, char ***list, int *count)
+{
+    char dir_path[PATH_MAX];
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    if (slash == NULL)
+        strcpy(dir_path, ".");
+    else if (slash == word)
+        strcpy(dir_path, "/");
+    else
+        snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(slash - word), word);
+
+    extension[0] = '\0';
+    struct dir_listing_t *listing = read_dir_listing(dir_path);
+    if (listing == NULL)
+        return 0;
+
+    size_t base_len = strlen(base);
+    int low = 0, high = listing->count;
+    while (low < high) // first name not below base
+    {
+        int mid = (low + high) / 2;
+        if (strcmp(listing->names[mid], base) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    const char *first = NULL;
+    size_t common = 0;
+    int matches = 0;
+    if (list != NULL)
+        *list = NULL;
+    for (int i = low; i < listing->count && strncmp(listing->names[i], base, base_len) == 0; i++)
+    {
+        const char *name = listing->names[i];
+        if (name[0] == '.' && base[0] != '.')
+            continue; // hidden files only complete when asked for
+        if (first == NULL)
+        {
+            first = name;
+            common = strlen(name);
+        }
+        while (common > base_len && strncmp(first, name, common) != 0)
+            common--;
+        if (list != NULL)
+        {
+            *list = realloc(*list, sizeof(char *) * (matches + 1));
+            (*list)[matches] = strdup(name);
+        }
+        matches++;
+    }
+    *count = matches;
+    if (matches == 0)
+        return 0;
+
+    size_t len = common - base_len < size - 1 ? common - base_len : size - 1;
+    memcpy(extension, first + base_len, len);
+    extension[len] = '\0';
+    return matches;
+}
+
+/**
+ * Print completion candidates in columns across the terminal
+ * @param names [description]
+ * @param count [description]
+ */
+void print_candidates(char **names, int count)
+{
+    struct winsize ws;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    int longest = 1;
+    for (int i = 0; i < count; i++)
+        if ((int)strlen(names[i]) > longest)
+            longest = strlen(names[i]);
+    int columns = width / (longest + 2);
+    if (columns < 1)
+        columns = 1;
+    int rows = (count + columns - 1) / columns;
+    for (int row = 0; row < rows; row++)
+    {
+        for (int column = 0; column < columns; column++)
+        {
+            int i = column * rows + row;
+            if (i < count)
+                printf("%-*s", column == columns - 1 ? 0 : longest + 2, names[i]);
+        }
+        putchar('\n');
+    }
+}
+
+/**
+ * Tab completion for the word under the cursor. The first word of a command
+ * completes against the command trie, anything else against file names.
+ * Whatever all matches share is inserted; a single match is finished with a
+ * space (or nothing after a directory). With show_all, the matches are
+ * listed instead when there was nothing to insert.
+ * @param  buf      [description]
+ * @param  index    length of the line, updated
+ * @param  size     [description]
+ * @param  show_all the previous key was also a tab
+ * @return          number of matches
+ */
+int complete_line(char *buf, int *index, int size, bool show_all)
+{
+    int start = *index;
+    while (start > 0 && strchr(" \t|&;<>()", buf[start - 1]) == NULL)
+        start--;
+    int before = start;
+    while (before > 0 && (buf[before - 1] == ' ' || buf[before - 1] == '\t'))
+        before--;
+    bool command_word = before == 0 || strchr("|&;(", buf[before - 1]) != NULL;
+
+    char word[PATH_MAX];
+    snprintf(word, sizeof(word), "%.*s", *index - start, buf + start);
+    command_word = command_word && strchr(word, '/') == NULL;
+
+    char extension[PATH_MAX];
+    char **names = NULL;
+    int count = 0;
+    // the names themselves are only needed when they are about to be listed
+    char ***list = show_all ? &names : NULL;
+    int matches = command_word ? complete_command(word, extension, sizeof(extension), list, &count)
+                               : complete_file(word, extension, sizeof(extension), list, &count);
+    bool finished = matches == 1 && (extension[0] == '\0' || extension[strlen(extension) - 1] != '/');
+
+    for (const char *p = extension; *p && *index < size - 3; p++)
+    {
+        // escape what the lexer would otherwise split on or interpret
+        if (strchr(" \t|&;<>()'\"\\$`", *p) != NULL)
+        {
+            putchar('\\');
+            buf[(*index)++] = '\\';
+        }
+        putchar(*p);
+        buf[(*index)++] = *p;
+    }
+    if (finished && *index < size - 1)
+    {
+        putchar(' ');
+        buf[(*index)++] = ' ';
+    }
+
+    if (matches > 1 && extension[0] == '\0' && show_all)
+    {
+        bool show = true;
+        if (count > COMPLETION_ASK_LIMIT)
+        {
+            printf("\nDisplay all %d possibilities? (y or n)", count);
+            fflush(stdout);
+            int c = getchar();
+            show = c == 'y' || c == 'Y' || c == ' ';
+        }
+        putchar('\n');
+        if (show)
+            print_candidates(names, count);
+        show_prompt();
+        printf("%.*s", *index, buf);
+    }
+    else if (matches != 1 && extension[0] == '\0')
+        putchar('\a'); // nothing to insert
+    for (int i = 0; names != NULL && i < count; i++)
+        free(names[i]);
+    free(names);
+    return matches;
+}
+
+/**
+ * Point stdin at the file named by "<"
+ * @param  command [description]
+ * @return         0 on success, -1 if the file could not be opened
+ */
+int redirect_input(struct command_t *command)
+{
+    if (command->redirects[0] == NULL)
+        return 0;
+    int fd = open(command->redirects[0], O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0], strerror(errno));
+        return -1;
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+    return 0;
+}
+
+/**
+ * Point stdout at the file named by ">" (truncate) or ">>" (append), and
+ * stderr at the one named by "2>" or "2>>" (or at stdout for 2>&1), so the
+ * output streams straight to disk from the command itself
+ * @param  command [description]
+ * @return         0 on success, -1 if a file could not be opened
+ */
+int redirect_output(struct command_t *command)
+{
+    for (int i = 1; i <= 4; i++)
+    {
+        if (command->redirects[i] == NULL)
+            continue;
+        int flags = O_WRONLY | O_CREAT | (i % 2 == 1 ? O_TRUNC : O_APPEND);
+        int fd = open(command->redirects[i], flags, 0644);
+        if (fd == -1)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+            return -1;
+        }
+        dup2(fd, i <= 2 ? STDOUT_FILENO : STDERR_FILENO);
+        close(fd);
+    }
+    if (command->stderr_to_stdout)
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+    return 0;
+}
+
+#define FANOUT_BUFFER (64 << 10) // copy buffer for targets splice(2) cannot write to
+
+struct fanout_t
+{
+    int fd;       // the command's stdout or stderr
+    int in;       // read end of the pipe the command writes to
+    int spare[2]; // pipe that tee(2) duplicates the data into, one target at a time
+    int *targets;
+    bool *appends; // targets opened O_APPEND, which splice(2) cannot write to
+    int count;
+    bool done;
+};
+
+/**
+ * Write all of a buffer to a target; the data of targets that fail is dropped
+ * @param to     -1 for a target that could not be opened
+ * @param buf    [description]
+ * @param length [description]
+ */
+void fanout_write(int to, const char *buf, size_t length)
+{
+    while (to != -1 && length > 0)
+    {
+        ssize_t n = write(to, buf, length);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        length -= n;
+    }
+}
+
+/**
+ * Move n bytes from a pipe into a target, with splice(2) so the data does
+ * not pass through user space. Append targets, and targets splice cannot
+ * write to (a terminal, say), are copied to with write(2) instead.
+ * @param from   a pipe
+ * @param to     [description]
+ * @param n      [description]
+ * @param append the target is O_APPEND, every write of it has to go to its end
+ */
+void fanout_splice(int from, int to, size_t n, bool append)
+{
+    static char buf[FANOUT_BUFFER];
+    while (n > 0)
+    {
+        ssize_t moved = -1;
+        if (to != -1 && !append)
+        {
+            moved = splice(from, NULL, to, NULL, n, SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINTR)
+                continue;
+        }
+        if (moved <= 0)
+        {
+            moved = read(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+            if (moved == -1 && errno == EINTR)
+                continue;
+            if (moved <= 0)
+                return;
+            fanout_write(to, buf, moved);
+        }
+        n -= moved;
+    }
+}
+
+/**
+ * Hand the next n bytes of the command's pipe, already tee(2)'d once into
+ * the spare pipe, to every target: the spare pipe goes to the second target
+ * and is refilled with the same bytes for each target after it, then the
+ * bytes are spliced out of the command's pipe to the first target. Should
+ * the spare pipe take fewer bytes than that, the rest of the round is read
+ * out and written by hand.
+ * @param out [description]
+ * @param n   bytes in the spare pipe
+ */
+void fanout_round(struct fanout_t *out, size_t n)
+{
+    static char buf[FANOUT_BUFFER];
+    for (int t = 1; t < out->count; t++)
+    {
+        ssize_t teed = n;
+        while (t > 1 && (teed = tee(out->in, out->spare[1], n, 0)) == -1 && errno == EINTR)
+            ;
+        if (teed < 0) // EAGAIN and the like: nothing duplicated this time
+            teed = 0;
+        fanout_splice(out->spare[0], out->targets[t], teed, out->appends[t]);
+        if ((size_t)teed == n)
+            continue;
+
+        size_t got = 0;
+        while (got < n)
+        {
+            ssize_t r = read(out->in, buf + got, n - got);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        if (got > (size_t)teed)
+            fanout_write(out->targets[t], buf + teed, got - teed);
+        for (t++; t < out->count; t++)
+            fanout_write(out->targets[t], buf, got);
+        fanout_write(out->targets[0], buf, got);
+        return;
+    }
+    fanout_splice(out->in, out->targets[0], n, out->appends[0]);
+}
+
+/**
+ * Feed every target of each fanned out fd until the command closes its end,
+ * a round of up to FANOUT_BUFFER bytes at a time
+ * @param outs  [description]
+ * @param count [description]
+ */
+void fanout_loop(struct fanout_t *outs, int count)
+{
+    int open_count = count;
+    while (open_count > 0)
+    {
+        struct pollfd fds[2];
+        for (int i = 0; i < count; i++)
+        {
+            fds[i].fd = outs[i].done ? -1 : outs[i].in;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, count, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            struct fanout_t *out = &outs[i];
+            if (out->done || fds[i].revents == 0)
+                continue;
+            ssize_t n = tee(out->in, out->spare[1], FANOUT_BUFFER, SPLICE_F_NONBLOCK);
+            if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n <= 0)
+            {
+                out->done = true;
+                open_count--;
+                continue;
+            }
+            fanout_round(out, n);
+        }
+    }
+}
+
+/**
+ * Add an output target to a fan-out. Append targets keep O_APPEND, so
+ * that their writes stay atomic appends, and are marked to be written to
+ * instead of spliced.
+ * @param  out    [description]
+ * @param  fd     an already open target, or -1 to open path
+ * @param  path   [description]
+ * @param  append [description]
+ * @return        0, -1 on error
+ */
+int fanout_target(struct fanout_t *out, int fd, const char *path, bool append)
+{
+    if (fd == -1 &&
+        (fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644)) == -1)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+        return -1;
+    }
+    out->appends[out->count] = (fcntl(fd, F_GETFL) & O_APPEND) != 0;
+    out->targets[out->count++] = fd;
+    return 0;
+}
+
+/**
+ * Give stdout and stderr all of their output targets: when a command has
+ * several for one fd, the command writes to a pipe instead, and this
+ * process stays behind to fan the pipe out to every target in the kernel
+ * with tee(2) and splice(2). Called after redirect_output() has opened the
+ * first target of each fd. Returns in the process that goes on to run the
+ * command; the fan-out process exits with the command's status.
+ * @param  command [description]
+ * @return         0, -1 if a target could not be opened
+ */
+int fan_out(struct command_t *command)
+{
+    if (command->fanout == NULL)
+        return 0;
+
+    struct fanout_t outs[2];
+    int count = 0;
+    for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++)
+    {
+        int targets = 1;
+        for (struct redirect_t *r = command->fanout; r != NULL; r = r->next)
+            targets += r->fd == fd;
+        if (targets == 1 || (fd == STDERR_FILENO && command->stderr_to_stdout))
+            continue;
+
+        struct fanout_t *out = &outs[count++];
+        memset(out, 0, sizeof(struct fanout_t));
+        out->fd = fd;
+        out->targets = malloc(sizeof(int) * targets);
+        out->appends = malloc(sizeof(bool) * targets);
+        if (fanout_target(out, fcntl(fd, F_DUPFD_CLOEXEC, 3), NULL, false) == -1)
+            return -1;
+        for (struct redirect_t *r = command->fanout; r != NULL; r = r->next)
+            if (r->fd == fd && fanout_target(out, -1, r->path, r->append) == -1)
+                return -1;
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) == -1 || pipe2(out->spare, O_CLOEXEC) == -1)
+        {
+            fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+            return -1;
+        }
+        out->in = p[0];
+        dup2(p[1], fd);
+        close(p[1]);
+        if (fd == STDOUT_FILENO && command->stderr_to_stdout)
+            dup2(STDOUT_FILENO, STDERR_FILENO);
+    }
+    if (count == 0)
+        return 0;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        fprintf(stderr, "-%s: fork: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) // runs the command; every fd of the fan-out is close-on-exec
+        return 0;
+
+    // the fan-out keeps none of the command's write ends, so it sees EOF
+    for (int i = 0; i < count; i++)
+        close(outs[i].fd);
+    if (command->stderr_to_stdout)
+        close(STDERR_FILENO);
+    fanout_loop(outs, count);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (WIFSIGNALED(status))
+        kill(getpid(), WTERMSIG(status));
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+#define CACHE_DEFAULT_TTL 600 // seconds a cached output is replayed for without -t
+
+// Environment variables that go into the key of a cached command, in
+// addition to any listed (colon separated) in $SHELLAX_CACHE_ENV
+static const char *cache_env[] = {"PATH", "HOME", "USER", "LANG", "LC_ALL", "TZ"};
+
+/**
+ * Mix a string and its terminating NUL into an FNV-1a hash
+ * @param  h    [description]
+ * @param  text NULL is mixed in as an empty string
+ * @return      [description]
+ */
+unsigned long cache_mix(unsigned long h, const char *text)
+{
+    for (const char *c = text ? text : ""; ; c++)
+    {
+        h ^= (unsigned char)*c;
+        h *= 1099511628211UL;
+        if (*c == '\0')
+            return h;
+    }
+}
+
+/**
+ * Mix the identity, size and modification time of a file into a hash
+ * @param  h  [description]
+ * @param  st [description]
+ * @return    [description]
+ */
+unsigned long cache_mix_stat(unsigned long h, const struct stat *st)
+{
+    char text[128];
+    snprintf(text, sizeof(text), "%lu:%lu:%lld:%lld.%ld", (unsigned long)st->st_dev, (unsigned long)st->st_ino,
+             (long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+    return cache_mix(h, text);
+}
+
+/**
+ * Mix the name, identity, size and modification time of a file into a hash, if it exists
+ * @param  h    [description]
+ * @param  path [description]
+ * @return      [description]
+ */
+unsigned long cache_mix_file(unsigned long h, const char *path)
+{
+    struct stat st;
+    if (path == NULL || stat(path, &st) == -1)
+        return h;
+    return cache_mix_stat(cache_mix(h, path), &st);
+}
+
+/**
+ * Key of a cached command: its arguments, the working directory, selected
+ * environment variables, and the size and mtime of its input file and of
+ * every argument that names a file
+ * @param  command the command to be cached
+ * @param  input   stdin when it is a regular file, whose identity and read
+ *                 position go in too, else NULL
+ * @return         [description]
+ */
+unsigned long cache_key(struct command_t *command, const struct stat *input)
+{
+    char cwd[PATH_MAX];
+    unsigned long h = cache_mix(14695981039346656037UL, command->name);
+    for (int i = 0; i < command->arg_count; i++)
+        h = cache_mix(h, command->args[i]);
+    h = cache_mix(h, getcwd(cwd, sizeof(cwd)));
+    for (size_t i = 0; i < sizeof(cache_env) / sizeof(cache_env[0]); i++)
+        h = cache_mix(cache_mix(h, cache_env[i]), getenv(cache_env[i]));
+    char *extra = getenv("SHELLAX_CACHE_ENV");
+    if (extra != NULL)
+    {
+        char *names = strdup(extra);
+        for (char *name = strtok(names, ":"); name != NULL; name = strtok(NULL, ":"))
+            h = cache_mix(cache_mix(h, name), getenv(name));
+        free(names);
+    }
+    h = cache_mix_file(h, command->redirects[0]);
+    if (input != NULL)
+    {
+        char offset[32];
+        snprintf(offset, sizeof(offset), "@%lld", (long long)lseek(STDIN_FILENO, 0, SEEK_CUR));
+        h = cache_mix(cache_mix_stat(h, input), offset);
+    }
+    for (int i = 0; i < command->arg_count; i++)
+        h = cache_mix_file(h, command->args[i]);
+    return h;
+}
+
+/**
+ * Directory of the output cache, $XDG_CACHE_HOME/shellax or
+ * ~/.cache/shellax, created if missing
+ * @param  path [description]
+ * @param  size [description]
+ * @return      0, -1 if there is no usable directory
+ */
+int cache_dir(char *path, size_t size)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n = xdg != NULL && xdg[0] != '\0' ? snprintf(path, size, "%s/shellax", xdg)
+            : home != NULL               ? snprintf(path, size, "%s/.cache/shellax", home)
+                                         : -1;
+    if (n < 0 || (size_t)n >= size)
+        return -1;
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+/**
+ * Write a cached output to stdout with sendfile(2), so it is copied in
+ * the kernel; outputs sendfile cannot write to are copied by hand
+ * @param  fd   the cache entry
+ * @param  size [description]
+ */
+void cache_replay(int fd, off_t size)
+{
+    static char buf[FANOUT_BUFFER];
+    fflush(stdout);
+    off_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, size - offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n > 0)
+            continue;
+        if (n == -1 && errno != EINVAL && errno != ENOSYS)
+            break;
+        if ((n = pread(fd, buf, sizeof(buf), offset)) <= 0 || write(STDOUT_FILENO, buf, n) != n)
+            break;
+        offset += n;
+    }
+}
+
+/**
+ * Run the cached command and wait for it. cache runs in a child of the
+ * shell already, so the command gets a child of its own.
+ * @param inner [description]
+ */
+void cache_run(struct command_t *inner)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+        exec_stage(inner);
+    int status = 0;
+    while (pid != -1 && waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    last_status = pid == -1 ? 1 : WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * The cache builtin: "cache [-t seconds] command [args...]" replays the
+ * output of an earlier run of the same command, if it succeeded less than
+ * the given time ago (10 minutes by default, 0 to always run it again).
+ * Otherwise the command runs with its stdout also fanned out to a new
+ * cache entry, which is kept if the command succeeds. Only commands whose
+ * stdin is a "<" file or a regular file are cached: what comes down a pipe
+ * or from the terminal cannot be keyed, so with those the command just runs.
+ * @param  command [description]
+ * @return         [description]
+ */
+int cache_builtin(struct command_t *command)
+{
+    uint64_t ttl = (uint64_t)CACHE_DEFAULT_TTL * 1000000000;
+    int skip = 0;
+    if (command->arg_count >= 2 && strcmp(command->args[0], "-t") == 0)
+    {
+        if (parse_seconds(command->args[1], &ttl) == -1)
+            skip = command->arg_count; // a usage error
+        else
+            skip = 2;
+    }
+    if (skip >= command->arg_count)
+    {
+        printf("Usage: cache [-t seconds] command [args...]\n");
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    // the cached command: the rest of the arguments, in the redirections cache itself got
+    struct command_t *inner = calloc(1, sizeof(struct command_t));
+    inner->name = command->args[skip];
+    inner->args = command->args + skip + 1;
+    inner->arg_count = command->arg_count - skip - 1;
+    inner->redirects[0] = command->redirects[0]; // only to key on it, stdin is in place already
+
+    struct stat input;
+    bool regular = fstat(STDIN_FILENO, &input) == 0 && S_ISREG(input.st_mode);
+    if (command->redirects[0] == NULL && !regular)
+    {
+        inner->redirects[0] = NULL;
+        cache_run(inner);
+        free(inner);
+        return SUCCESS;
+    }
+
+    char dir[PATH_MAX], path[PATH_MAX + 32], temp[PATH_MAX + 64];
+    if (cache_dir(dir, sizeof(dir)) == -1)
+    {
+        fprintf(stderr, "-%s: cache: no cache directory\n", sysname);
+        last_status = 1;
+        free(inner);
+        return SUCCESS;
+    }
+    unsigned long key = cache_key(inner, regular ? &input : NULL);
+    inner->redirects[0] = NULL;
+    snprintf(path, sizeof(path), "%s/%016lx", dir, key);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t age = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + (now.tv_nsec - st.st_mtim.tv_nsec);
+        if (age < ttl)
+        {
+            cache_replay(fd, st.st_size);
+            close(fd);
+            free(inner);
+            return SUCCESS;
+        }
+    }
+    if (fd != -1)
+        close(fd);
+
+    // a miss: tee stdout into a temporary entry, then keep it if the command succeeds
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, getpid());
+    struct redirect_t entry = {temp, STDOUT_FILENO, false, NULL};
+    inner->fanout = &entry;
+    cache_run(inner);
+    if (last_status != 0 || rename(temp, path) == -1)
+        unlink(temp);
+    free(inner);
+    return SUCCESS;
+}
+
+/**
+ * Map a whole file read-only into memory
+ * @param  path   [description]
+ * @param  length set to the size of the file
+ * @return        the mapping, NULL on error (an empty file maps to "")
+ */
+char *map_input(const char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    *length = st.st_size;
+    if (*length == 0)
+    {
+        close(fd);
+        return "";
+    }
+    char *data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+        return NULL;
+    }
+    madvise(data, *length, MADV_SEQUENTIAL);
+    return data;
+}
+
+#define UNIQ_BLOCK_SIZE (1 << 20) // bytes read from the input at a time
+
+struct uniq_options
+{
+    bool count;       // -c: prefix lines with the number of occurrences
+    bool repeated;    // -d: only print lines that are repeated
+    bool unique;      // -u: only print lines that are not repeated
+    bool ignore_case; // -i: compare lines case-insensitively
+    bool global;      // --global: count equal lines anywhere in the input, not just adjacent ones
+    long top;         // --top N: print only the N most frequent lines, implies --global
+};
+
+struct uniq_state
+{
+    struct uniq_options options;
+    char *prev; // copy of the first line of the current group
+    size_t prev_len;
+    size_t prev_cap;
+    long count; // number of lines in the current group, 0 before the first line
+};
+
+/**
+ * Parse the options of uniq
+ * @param  command  [description]
+ * @param  options  [description]
+ * @param  input    set to the input file argument, if any
+ * @param  report   print an unknown option
+ * @return          0 on success, -1 on an unknown option
+ */
+int uniq_parse_options(struct command_t *command, struct uniq_options *options, char **input, bool report)
+{
+    memset(options, 0, sizeof(struct uniq_options));
+    *input = NULL;
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        char *arg = command->args[i];
+        if (strcmp(arg, "--count") == 0)
+            options->count = true;
+        else if (strcmp(arg, "--repeated") == 0)
+            options->repeated = true;
+        else if (strcmp(arg, "--unique") == 0)
+            options->unique = true;
+        else if (strcmp(arg, "--ignore-case") == 0)
+            options->ignore_case = true;
+        else if (strcmp(arg, "--global") == 0)
+            options->global = true;
+        else if (strcmp(arg, "--top") == 0 && i + 1 < command->arg_count)
+        {
+            options->top = atol(command->args[++i]);
+            options->global = true;
+        }
+        else if (arg[0] == '-' && arg[1] != '\0')
+        {
+            for (int k = 1; arg[k] != '\0'; k++) // combined flags such as -ci
+            {
+                if (arg[k] == 'c')
+                    options->count = true;
+                else if (arg[k] == 'd')
+                    options->repeated = true;
+                else if (arg[k] == 'u')
+                    options->unique = true;
+                else if (arg[k] == 'i')
+                    options->ignore_case = true;
+                else
+                {
+                    if (report)
+                        printf("-%s: uniq: invalid option -- '%c'\n", sysname, arg[k]);
+                    return -1;
+                }
+            }
+        }
+        else
+            *input = arg;
+    }
+    return 0;
+}
+
+/**
+ * Status uniq gives its options, without running it or printing anything
+ * @param  command [description]
+ * @return         0, 1 if it rejects them
+ */
+int uniq_options_status(struct command_t *command)
+{
+    struct uniq_options options;
+    char *input;
+    return uniq_parse_options(command, &options, &input, false) == 0 ? 0 : 1;
+}
+
+/**
+ * Print the pending group if the options select it
+ * @param state [description]
+ */
+void uniq_flush(struct uniq_state *state)
+{
+    if (state->count == 0)
+        return;
+    if ((state->options.repeated && state->count < 2) ||
+        (state->options.unique && state->count > 1))
+        return;
+    if (state->options.count)
+        printf("%7ld ", state->count);
+    fwrite(state->prev, 1, state->prev_len, stdout);
+    putchar('\n');
+}
+
+/**
+ * Feed one line (without its newline) to uniq. Only the previous line is
+ * kept, so memory does not grow with the size of the input.
+ * @param state [description]
+ * @param line  [description]
+ * @param len   [description]
+ */
+void uniq_line(struct uniq_state *state, const char *line, size_t len)
+{
+    if (state->count > 0 && len == state->prev_len &&
+        (state->options.ignore_case ? strncasecmp(line, state->prev, len) == 0
+                                    : memcmp(line, state->prev, len) == 0))
+    {
+        state->count++; // same as the previous line, extend the group
+        return;
+    }
+
+    uniq_flush(state);
+    if (len > state->prev_cap)
+    {
+        state->prev_cap = len * 2;
+        state->prev = realloc(state->prev, state->prev_cap);
+    }
+    memcpy(state->prev, line, len);
+    state->prev_len = len;
+    state->count = 1;
+}
+
+/**
+ * Feed every complete line of a block to uniq. Newlines are found with
+ * memchr(), which glibc implements with vector instructions.
+ * @param  state [description]
+ * @param  data  [description]
+ * @param  len   [description]
+ * @param  final treat a trailing line without newline as complete
+ * @return       number of bytes consumed
+ */
+size_t uniq_buffer(struct uniq_state *state, const char *data, size_t len, bool final)
+{
+    const char *pos = data;
+    const char *end = data + len;
+    const char *newline;
+    while ((newline = memchr(pos, '\n', end - pos)) != NULL)
+    {
+        uniq_line(state, pos, newline - pos);
+        pos = newline + 1;
+    }
+    if (final && pos < end)
+    {
+        uniq_line(state, pos, end - pos);
+        pos = end;
+    }
+    return pos - data;
+}
+
+/**
+ * Run uniq over everything that can be read from fd, in large blocks. A line
+ * split across two reads is moved to the front of the buffer; the buffer only
+ * grows if a single line is longer than it.
+ * @param state [description]
+ * @param fd    [description]
+ */
+void uniq_stream(struct uniq_state *state, int fd)
+{
+    size_t cap = UNIQ_BLOCK_SIZE;
+    char *buf = malloc(cap);
+    size_t filled = 0;
+    ssize_t n;
+    while (1)
+    {
+        if (filled == cap) // a line longer than the buffer
+        {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        n = read(fd, buf + filled, cap - filled);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        filled += n;
+        size_t used = uniq_buffer(state, buf, filled, false);
+        memmove(buf, buf + used, filled - used);
+        filled -= used;
+    }
+    uniq_buffer(state, buf, filled, true);
+    free(buf);
+}
+
+#define UNIQ_CHUNK_SIZE (4 << 20) // bytes a --global worker counts at a time
+#define UNIQ_MAX_THREADS 16       // workers counting lines in --global mode
+
+// uniq --global counts every distinct line of unsorted input. The input is
+// cut into chunks on line boundaries, and worker threads take chunks in turn
+// and count their lines in a hash table of their own; the tables are merged
+// once every chunk is done. Entries point into the input instead of copying
+// the lines, and remember where a line was first seen so the output is in
+// order of first appearance (or of count, with --top).
+
+struct uniq_entry_t
+{
+    const char *line; // into the input, NULL for an empty slot
+    size_t len;
+    unsigned long hash;
+    uint64_t first; // input offset of the first occurrence
+    long count;
+};
+
+struct uniq_table_t
+{
+    struct uniq_entry_t *slots;
+    size_t size; // a power of two
+    size_t used;
+};
+
+struct uniq_chunk_t
+{
+    const char *data; // whole lines only
+    size_t len;
+    uint64_t offset; // of data in the input
+};
+
+struct uniq_global_t
+{
+    struct uniq_options *options;
+    struct uniq_chunk_t *chunks;
+    int chunk_count;
+    atomic_int next_chunk; // the next chunk a worker takes
+};
+
+struct uniq_worker_t
+{
+    struct uniq_global_t *global;
+    struct uniq_table_t table;
+    pthread_t thread;
+};
+
+/**
+ * FNV-1a hash of a line, case-folded for -i
+ * @param  line        [description]
+ * @param  len         [description]
+ * @param  ignore_case [description]
+ * @return             [description]
+ */
+unsigned long uniq_hash(const char *line, size_t len, bool ignore_case)
+{
+    if (!ignore_case)
+        return history_hash(line, len);
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)tolower((unsigned char)line[i]);
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/**
+ * Add count occurrences of a line to a table, growing it at half load
+ * @param table       [description]
+ * @param entry       line, length, hash, first position and count
+ * @param ignore_case [description]
+ */
+void uniq_table_add(struct uniq_table_t *table, struct uniq_entry_t *entry, bool ignore_case)
+{
+    if (table->used * 2 >= table->size)
+    {
+        struct uniq_table_t grown = {calloc(table->size * 2, sizeof(struct uniq_entry_t)), table->size * 2, 0};
+        for (size_t i = 0; i < table->size; i++)
+            if (table->slots[i].line != NULL)
+                uniq_table_add(&grown, &table->slots[i], ignore_case);
+        free(table->slots);
+        *table = grown;
+    }
+
+    size_t slot = entry->hash & (table->size - 1);
+    for (; table->slots[slot].line != NULL; slot = (slot + 1) & (table->size - 1))
+    {
+        struct uniq_entry_t *found = &table->slots[slot];
+        if (found->hash == entry->hash && found->len == entry->len &&
+            (ignore_case ? strncasecmp(found->line, entry->line, entry->len) == 0
+                         : memcmp(found->line, entry->line, entry->len) == 0))
+        {
+            found->count += entry->count;
+            if (entry->first < found->first) // keep the text of the first occurrence
+            {
+                found->line = entry->line;
+                found->first = entry->first;
+            }
+            return;
+        }
+    }
+    table->slots[slot] = *entry;
+    table->used++;
+}
+
+/**
+ * Worker thread of uniq --global: count the lines of chunks until none are left
+ * @param  arg the worker
+ * @return     [description]
+ */
+void *uniq_worker(void *arg)
+{
+    struct uniq_worker_t *worker = arg;
+    struct uniq_global_t *global = worker->global;
+    bool ignore_case = global->options->ignore_case;
+    int i;
+    while ((i = atomic_fetch_add(&global->next_chunk, 1)) < global->chunk_count)
+    {
+        struct uniq_chunk_t *chunk = &global->chunks[i];
+        const char *pos = chunk->data;
+        const char *end = chunk->data + chunk->len;
+        while (pos < end)
+        {
+            const char *newline = memchr(pos, '\n', end - pos);
+            struct uniq_entry_t entry;
+            entry.line = pos;
+            entry.len = (newline ? newline : end) - pos;
+            entry.hash = uniq_hash(pos, entry.len, ignore_case);
+            entry.first = chunk->offset + (pos - chunk->data);
+            entry.count = 1;
+            uniq_table_add(&worker->table, &entry, ignore_case);
+            pos = newline ? newline + 1 : end;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Cut a mapped input into chunks of about UNIQ_CHUNK_SIZE on line boundaries
+ * @param  data   [description]
+ * @param  len    [description]
+ * @param  chunks set to a malloc'd array
+ * @return        number of chunks
+ */
+int uniq_split(const char *data, size_t len, struct uniq_chunk_t **chunks)
+{
+    int count = 0;
+    *chunks = malloc(sizeof(struct uniq_chunk_t) * (len / UNIQ_CHUNK_SIZE + 1));
+    size_t pos = 0;
+    while (pos < len)
+    {
+        size_t end = pos + UNIQ_CHUNK_SIZE < len ? pos + UNIQ_CHUNK_SIZE : len;
+        const char *newline = end < len ? memchr(data + end, '\n', len - end) : NULL;
+        end = newline ? (size_t)(newline - data) + 1 : len;
+        (*chunks)[count++] = (struct uniq_chunk_t){data + pos, end - pos, pos};
+        pos = end;
+    }
+    return count;
+}
+
+/**
+ * Read all of fd into malloc'd chunks of whole lines, for input that cannot be mapped
+ * @param  fd     [description]
+ * @param  chunks set to a malloc'd array; each chunk's data is malloc'd too
+ * @return        number of chunks
+ */
+int uniq_drain(int fd, struct uniq_chunk_t **chunks)
+{
+    int count = 0;
+    int cap = 16;
+    *chunks = malloc(sizeof(struct uniq_chunk_t) * cap);
+    size_t size = UNIQ_CHUNK_SIZE;
+    char *buf = malloc(size);
+    size_t filled = 0;
+    uint64_t offset = 0;
+    while (1)
+    {
+        ssize_t n = read(fd, buf + filled, size - filled);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n > 0 && (filled += n) < size)
+            continue;
+
+        // the buffer is full or the input ended: the whole lines make a chunk
+        size_t keep = 0;
+        if (n > 0)
+        {
+            char *newline = memrchr(buf, '\n', filled);
+            if (newline == NULL) // a line longer than the buffer
+            {
+                size *= 2;
+                buf = realloc(buf, size);
+                continue;
+            }
+            keep = buf + filled - (newline + 1);
+        }
+        if (filled > keep)
+        {
+            if (count == cap)
+                *chunks = realloc(*chunks, sizeof(struct uniq_chunk_t) * (cap *= 2));
+            (*chunks)[count++] = (struct uniq_chunk_t){buf, filled - keep, offset};
+            offset += filled - keep;
+        }
+        else
+            free(buf);
+        if (n <= 0)
+            break;
+
+        size = keep < UNIQ_CHUNK_SIZE / 2 ? UNIQ_CHUNK_SIZE : keep * 2;
+        char *next = malloc(size);
+        memcpy(next, buf + filled - keep, keep);
+        buf = next;
+        filled = keep;
+    }
+    return count;
+}
+
+int compare_uniq_first(const void *a, const void *b)
+{
+    const struct uniq_entry_t *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+int compare_uniq_count(const void *a, const void *b)
+{
+    const struct uniq_entry_t *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return compare_uniq_first(a, b);
+}
+
+/**
+ * uniq --global: count the lines of the chunks on worker threads, merge the
+ * counts and print them in order of first appearance, or the --top N most
+ * frequent lines
+ * @param options [description]
+ * @param chunks  [description]
+ * @param count   number of chunks
+ */
+void uniq_global(struct uniq_options *options, struct uniq_chunk_t *chunks, int count)
+{
+    struct uniq_global_t global = {options, chunks, count, 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > UNIQ_MAX_THREADS ? UNIQ_MAX_THREADS : cpus;
+    if (threads > count)
+        threads = count > 0 ? count : 1;
+
+    struct uniq_worker_t workers[UNIQ_MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].global = &global;
+        workers[i].table = (struct uniq_table_t){calloc(1024, sizeof(struct uniq_entry_t)), 1024, 0};
+    }
+    // the calling thread is worker 0
+    int started = 1;
+    for (; started < threads; started++)
+        if (pthread_create(&workers[started].thread, NULL, uniq_worker, &workers[started]) != 0)
+            break;
+    uniq_worker(&workers[0]);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        struct uniq_table_t *table = &workers[i].table;
+        for (size_t k = 0; k < table->size; k++)
+            if (table->slots[k].line != NULL)
+                uniq_table_add(&workers[0].table, &table->slots[k], options->ignore_case);
+        free(table->slots);
+    }
+    for (int i = started; i < threads; i++)
+        free(workers[i].table.slots);
+
+    // pack the merged table and put it in output order
+    struct uniq_table_t *table = &workers[0].table;
+    size_t used = 0;
+    for (size_t k = 0; k < table->size; k++)
+        if (table->slots[k].line != NULL)
+            table->slots[used++] = table->slots[k];
+    qsort(table->slots, used, sizeof(struct uniq_entry_t), options->top > 0 ? compare_uniq_count : compare_uniq_first);
+
+    long printed = 0;
+    for (size_t k = 0; k < used && (options->top == 0 || printed < options->top); k++)
+    {
+        struct uniq_entry_t *entry = &table->slots[k];
+        if ((options->repeated && entry->count < 2) || (options->unique && entry->count > 1))
+            continue;
+        if (options->count)
+            printf("%7ld ", entry->count);
+        fwrite(entry->line, 1, entry->len, stdout);
+        putchar('\n');
+        printed++;
+    }
+    free(table->slots);
+}
+
+/**
+ * Run uniq in-process. Input given with "<" or as a file argument is
+ * memory-mapped instead of being copied, anything else is streamed from fd
+ * (or, with --global, read into chunks first).
+ * @param command [description]
+ * @param fd      [description]
+ */
+void uniq_builtin(struct command_t *command, int fd)
+{
+    struct uniq_state state;
+    char *path;
+    memset(&state, 0, sizeof(state));
+    if (uniq_parse_options(command, &state.options, &path, true) == -1)
+    {
+        last_status = 1;
+        return;
+    }
+    if (path == NULL)
+        path = command->redirects[0];
+
+    if (state.options.global)
+    {
+        struct uniq_chunk_t *chunks;
+        int count;
+        size_t length = 0;
+        char *input = NULL;
+        if (path != NULL)
+        {
+            if ((input = map_input(path, &length)) == NULL)
+                return;
+            count = uniq_split(input, length, &chunks);
+        }
+        else
+            count = uniq_drain(fd, &chunks);
+        uniq_global(&state.options, chunks, count);
+        if (input == NULL)
+            for (int i = 0; i < count; i++)
+                free((char *)chunks[i].data);
+        else if (length > 0)
+            munmap(input, length);
+        free(chunks);
+        fflush(stdout);
+        return;
+    }
+
+    if (path != NULL)
+    {
+        size_t length;
+        char *input = map_input(path, &length);
+        if (input == NULL)
+            return;
+        uniq_buffer(&state, input, length, true);
+        if (length > 0)
+            munmap(input, length);
+    }
+    else
+        uniq_stream(&state, fd);
+
+    uniq_flush(&state);
+    fflush(stdout);
+    free(state.prev);
+}
+
+/**
+ * uniq as a registered builtin, reading stdin unless given a file
+ * @param  command [description]
+ * @return         [description]
+ */
+int uniq_command(struct command_t *command)
+{
+    uniq_builtin(command, STDIN_FILENO);
+    return SUCCESS;
+}
+
+#define SORT_DEFAULT_MEMORY (128 << 20) // -S default: bytes of input and line records held at once
+#define SORT_MIN_MEMORY (64 << 10)
+#define SORT_MAX_THREADS 16             // pieces a batch is sorted in, in parallel
+#define SORT_THREAD_LINES 65536         // fewer lines than this per piece are sorted on one thread
+#define SORT_RUN_BUFFER (256 << 10)     // read buffer of each spilled run while merging
+
+// sort reads its input into a batch buffer until the memory budget is used
+// up, sorts the batch in pieces on several threads and merges the pieces
+// with a loser tree. A batch that is not the last is merged into a run file
+// (spilled); at the end the runs and the pieces of the last batch are merged
+// into the output. Fed into uniq, the merged lines go straight to uniq_line().
+
+struct sort_options_t
+{
+    bool numeric;    // -n
+    bool reverse;    // -r
+    bool unique;     // -u: only the first of lines with equal keys
+    int key_start;   // -k N[,M]: key from field N to field M, 1-based; 0 for the whole line
+    int key_end;     // 0 for the end of the line
+    char separator;  // -t c; fields are separated by blanks by default
+    size_t memory;   // -S size
+};
+
+#define SORT_INSERTION_LINES 16 // pieces this small are insertion sorted
+
+struct sort_line_t
+{
+    const char *text;
+    const char *key; // the compared part of text
+    uint32_t len;
+    uint32_t key_len;
+    union
+    {
+        double number;   // value of the key for -n
+        uint64_t prefix; // first 8 bytes of the key, big-endian and zero padded, otherwise
+    };
+};
+
+struct sort_source_t
+{
+    struct sort_line_t line; // the current line
+    bool done;
+    struct sort_line_t *lines; // a sorted piece in memory, or
+    size_t count;
+    size_t pos;
+    FILE *run;                 // a spilled run
+    char *buf;
+    size_t cap;
+    size_t start; // of the unread part of buf
+    size_t filled;
+};
+
+struct sort_sink_t
+{
+    struct sort_options_t *options;
+    FILE *out;                // where lines are written, unless
+    struct uniq_state *uniq;  // they are fed to a fused uniq
+    char *prev;               // copy of the last line written, for -u
+    size_t prev_cap;
+    struct sort_line_t prev_line;
+    bool has_prev;
+};
+
+struct sort_piece_t
+{
+    struct sort_options_t *options;
+    struct sort_line_t *lines;
+    struct sort_line_t *scratch; // as long as lines
+    size_t count;
+    pthread_t thread;
+};
+
+/**
+ * Find the key of a line for -k and -t, and its value for -n
+ * @param options [description]
+ * @param line    text and len set, key and number are filled in
+ */
+void sort_key(struct sort_options_t *options, struct sort_line_t *line)
+{
+    const char *pos = line->text;
+    const char *end = line->text + line->len;
+    if (options->key_start > 0)
+    {
+        // fields are split at each separator, or are runs of non-blanks
+        for (int field = 1; field < options->key_start && pos < end; field++)
+        {
+            if (options->separator != '\0')
+            {
+                const char *next = memchr(pos, options->separator, end - pos);
+                pos = next ? next + 1 : end;
+            }
+            else
+            {
+                while (pos < end && isblank((unsigned char)*pos))
+                    pos++;
+                while (pos < end && !isblank((unsigned char)*pos))
+                    pos++;
+            }
+        }
+        if (options->separator == '\0')
+            while (pos < end && isblank((unsigned char)*pos))
+                pos++;
+
+        if (options->key_end >= options->key_start)
+        {
+            const char *stop = pos;
+            for (int field = options->key_start; field <= options->key_end && stop < end; field++)
+            {
+                if (field > options->key_start)
+                    stop++; // past the separator or blank ending the previous field
+                if (options->separator != '\0')
+                {
+                    const char *next = memchr(stop, options->separator, end - stop);
+                    stop = next ? next : end;
+                }
+                else
+                {
+                    while (stop < end && isblank((unsigned char)*stop))
+                        stop++;
+                    while (stop < end && !isblank((unsigned char)*stop))
+                        stop++;
+                }
+            }
+            end = stop;
+        }
+    }
+    line->key = pos;
+    line->key_len = end - pos;
+
+    if (options->numeric) // leading blanks, a sign, digits and a fraction; anything else is 0
+    {
+        double value = 0, scale = 1;
+        bool negative = false;
+        while (pos < end && isblank((unsigned char)*pos))
+            pos++;
+        if (pos < end && *pos == '-')
+        {
+            negative = true;
+            pos++;
+        }
+        for (; pos < end && isdigit((unsigned char)*pos); pos++)
+            value = value * 10 + (*pos - '0');
+        if (pos < end && *pos == '.')
+            for (pos++; pos < end && isdigit((unsigned char)*pos); pos++)
+                value += (*pos - '0') * (scale /= 10);
+        line->number = negative ? -value : value;
+    }
+    else
+    {
+        // most comparisons are decided by the prefix alone; bytes past the
+        // end of a shorter key compare as 0, which orders it first
+        line->prefix = 0;
+        for (size_t i = 0; i < 8 && i < line->key_len; i++)
+            line->prefix |= (uint64_t)(unsigned char)line->key[i] << (56 - 8 * i);
+    }
+}
+
+/**
+ * Compare two lines by their keys. Lines with equal keys are compared as a
+ * whole, except with -u where they count as the same line.
+ * @param  a       [description]
+ * @param  b       [description]
+ * @param  options [description]
+ * @return         [description]
+ */
+int sort_compare(const struct sort_line_t *a, const struct sort_line_t *b, struct sort_options_t *options)
+{
+    int r;
+    if (options->numeric)
+        r = (a->number > b->number) - (a->number < b->number);
+    else if (a->prefix != b->prefix)
+        r = a->prefix < b->prefix ? -1 : 1;
+    else
+    {
+        r = memcmp(a->key, b->key, a->key_len < b->key_len ? a->key_len : b->key_len);
+        if (r == 0)
+            r = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+    }
+    if (r == 0 && !options->unique && (options->numeric || options->key_start > 0))
+    {
+        r = memcmp(a->text, b->text, a->len < b->len ? a->len : b->len);
+        if (r == 0)
+            r = (a->len > b->len) - (a->len < b->len);
+    }
+    return options->reverse ? -r : r;
+}
+
+/**
+ * Merge sort of line records: halves are sorted in place and merged
+ * through scratch, skipping the merge when the halves are already in order
+ * @param lines   [description]
+ * @param scratch at least count records
+ * @param count   [description]
+ * @param options [description]
+ */
+void sort_lines(struct sort_line_t *lines, struct sort_line_t *scratch, size_t count, struct sort_options_t *options)
+{
+    if (count <= SORT_INSERTION_LINES)
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            struct sort_line_t line = lines[i];
+            size_t k = i;
+            for (; k > 0 && sort_compare(&line, &lines[k - 1], options) < 0; k--)
+                lines[k] = lines[k - 1];
+            lines[k] = line;
+        }
+        return;
+    }
+    size_t half = count / 2;
+    sort_lines(lines, scratch, half, options);
+    sort_lines(lines + half, scratch, count - half, options);
+    if (sort_compare(&lines[half - 1], &lines[half], options) <= 0)
+        return;
+
+    size_t a = 0, b = half, out = 0;
+    while (a < half && b < count)
+        scratch[out++] = sort_compare(&lines[b], &lines[a], options) < 0 ? lines[b++] : lines[a++];
+    while (a < half)
+        scratch[out++] = lines[a++];
+    memcpy(lines, scratch, sizeof(struct sort_line_t) * out); // the rest of b is in place already
+}
+
+/**
+ * Pass a line to the output, dropping it if -u and its key was just written
+ * @param sink [description]
+ * @param line [description]
+ */
+void sort_emit(struct sort_sink_t *sink, struct sort_line_t *line)
+{
+    if (sink->options->unique)
+    {
+        if (sink->has_prev && sort_compare(line, &sink->prev_line, sink->options) == 0)
+            return;
+        if (line->len > sink->prev_cap)
+        {
+            sink->prev_cap = line->len * 2;
+            sink->prev = realloc(sink->prev, sink->prev_cap);
+        }
+        memcpy(sink->prev, line->text, line->len);
+        sink->prev_line.text = sink->prev;
+        sink->prev_line.len = line->len;
+        sort_key(sink->options, &sink->prev_line);
+        sink->has_prev = true;
+    }
+    if (sink->uniq != NULL)
+        uniq_line(sink->uniq, line->text, line->len);
+    else
+    {
+        fwrite(line->text, 1, line->len, sink->out);
+        putc('\n', sink->out);
+    }
+}
+
+/**
+ * Move a source to its next line, reading more of a run file when needed
+ * @param options [description]
+ * @param source  [description]
+ */
+void sort_source_next(struct sort_options_t *options, struct sort_source_t *source)
+{
+    if (source->run == NULL)
+    {
+        if (source->pos < source->count)
+            source->line = source->lines[source->pos++];
+        else
+            source->done = true;
+        return;
+    }
+
+    while (1)
+    {
+        char *newline = memchr(source->buf + source->start, '\n', source->filled - source->start);
+        if (newline != NULL)
+        {
+            source->line.text = source->buf + source->start;
+            source->line.len = newline - source->line.text;
+            source->start = newline + 1 - source->buf;
+            sort_key(options, &source->line);
+            return;
+        }
+        // move the partial line to the front and read more, growing for a long line
+        memmove(source->buf, source->buf + source->start, source->filled - source->start);
+        source->filled -= source->start;
+        source->start = 0;
+        if (source->filled == source->cap)
+            source->buf = realloc(source->buf, source->cap *= 2);
+        ssize_t n = read(fileno(source->run), source->buf + source->filled, source->cap - source->filled);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) // runs only hold whole lines
+        {
+            source->done = true;
+            return;
+        }
+        source->filled += n;
+    }
+}
+
+/**
+ * Whether source a wins over source b in the loser tree. Index k stands for
+ * a source that wins over everything, used to build the tree.
+ * @param  sources [description]
+ * @param  k       [description]
+ * @param  a       [description]
+ * @param  b       [description]
+ * @param  options [description]
+ * @return         [description]
+ */
+bool sort_beats(struct sort_source_t *sources, int k, int a, int b, struct sort_options_t *options)
+{
+    if (a == k || b == k)
+        return a == k;
+    if (sources[a].done || sources[b].done)
+        return !sources[a].done;
+    int r = sort_compare(&sources[a].line, &sources[b].line, options);
+    return r < 0 || (r == 0 && a < b); // ties go to the earlier source
+}
+
+/**
+ * Replay the matches from leaf s of the loser tree up to the root
+ * @param tree    losers of each match, the overall winner in tree[0]
+ * @param sources [description]
+ * @param k       [description]
+ * @param s       [description]
+ * @param options [description]
+ */
+void sort_adjust(int *tree, struct sort_source_t *sources, int k, int s, struct sort_options_t *options)
+{
+    for (int t = (s + k) / 2; t > 0; t /= 2)
+    {
+        if (sort_beats(sources, k, tree[t], s, options))
+        {
+            int winner = tree[t];
+            tree[t] = s;
+            s = winner;
+        }
+    }
+    tree[0] = s;
+}
+
+/**
+ * k-way merge of sorted sources into a sink with a loser tree: each line
+ * costs log2(k) comparisons against the losers on its leaf's path
+ * @param options [description]
+ * @param sources [description]
+ * @param k       [description]
+ * @param sink    [description]
+ */
+void sort_merge(struct sort_options_t *options, struct sort_source_t *sources, int k, struct sort_sink_t *sink)
+{
+    if (k == 0)
+        return;
+    int *tree = malloc(sizeof(int) * k);
+    for (int i = 0; i < k; i++)
+    {
+        tree[i] = k;
+        sort_source_next(options, &sources[i]);
+    }
+    for (int i = k - 1; i >= 0; i--)
+        sort_adjust(tree, sources, k, i, options);
+    while (!sources[tree[0]].done)
+    {
+        int s = tree[0];
+        sort_emit(sink, &sources[s].line);
+        sort_source_next(options, &sources[s]);
+        sort_adjust(tree, sources, k, s, options);
+    }
+    free(tree);
+}
+
+void *sort_piece(void *arg)
+{
+    struct sort_piece_t *piece = arg;
+    sort_lines(piece->lines, piece->scratch, piece->count, piece->options);
+    return NULL;
+}
+
+/**
+ * Sort a batch of lines in pieces, one per thread, and turn each piece
+ * into a merge source
+ * @param  options [description]
+ * @param  lines   [description]
+ * @param  scratch as long as lines
+ * @param  count   [description]
+ * @param  sources filled with the pieces
+ * @return         number of pieces
+ */
+int sort_batch(struct sort_options_t *options, struct sort_line_t *lines, struct sort_line_t *scratch, size_t count,
+               struct sort_source_t *sources)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t pieces = cpus < 1 ? 1 : cpus > SORT_MAX_THREADS ? SORT_MAX_THREADS : cpus;
+    if (pieces > count / SORT_THREAD_LINES)
+        pieces = count / SORT_THREAD_LINES > 0 ? count / SORT_THREAD_LINES : 1;
+
+    struct sort_piece_t piece[SORT_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 0; i < pieces; i++)
+    {
+        piece[i].options = options;
+        piece[i].lines = lines + count * i / pieces;
+        piece[i].scratch = scratch + count * i / pieces;
+        piece[i].count = count * (i + 1) / pieces - count * i / pieces;
+        memset(&sources[i], 0, sizeof(struct sort_source_t));
+        sources[i].lines = piece[i].lines;
+        sources[i].count = piece[i].count;
+    }
+    // the calling thread sorts the first piece
+    for (started = 1; started < pieces; started++)
+        if (pthread_create(&piece[started].thread, NULL, sort_piece, &piece[started]) != 0)
+            break;
+    for (size_t i = started; i < pieces; i++)
+        sort_piece(&piece[i]);
+    sort_piece(&piece[0]);
+    for (size_t i = 1; i < started; i++)
+        pthread_join(piece[i].thread, NULL);
+    return pieces;
+}
+
+/**
+ * Sort everything readable from the input fds into a sink, within the memory budget
+ * @param options [description]
+ * @param fds     [description]
+ * @param nfds    [description]
+ * @param sink    [description]
+ */
+void sort_run(struct sort_options_t *options, int *fds, int nfds, struct sort_sink_t *sink)
+{
+    // half of the budget holds the text, the other half the line records and the merge sort's scratch
+    size_t cap = options->memory / 2;
+    char *buf = malloc(cap);
+    size_t max_lines = options->memory / 4 / sizeof(struct sort_line_t);
+    struct sort_line_t *lines = malloc(sizeof(struct sort_line_t) * max_lines);
+    struct sort_line_t *scratch = malloc(sizeof(struct sort_line_t) * max_lines);
+    size_t count = 0;
+    size_t filled = 0; // bytes in buf
+    size_t parsed = 0; // bytes of buf already split into lines
+    FILE **runs = NULL;
+    int run_count = 0;
+    struct sort_source_t pieces[SORT_MAX_THREADS];
+
+    for (int f = 0; f < nfds; f++)
+    {
+        bool eof = false;
+        while (!eof)
+        {
+            if (filled == cap || count == max_lines)
+            {
+                if (count > 0) // spill the batch to a run file
+                {
+                    const char *tmpdir = getenv("TMPDIR");
+                    char path[PATH_MAX];
+                    snprintf(path, sizeof(path), "%s/shellax-sortXXXXXX", tmpdir ? tmpdir : "/tmp");
+                    int fd = mkstemp(path);
+                    if (fd == -1)
+                    {
+                        fprintf(stderr, "-%s: sort: %s: %s\n", sysname, path, strerror(errno));
+                        goto out;
+                    }
+                    unlink(path); // the run disappears with its fd
+                    runs = realloc(runs, sizeof(FILE *) * (run_count + 1));
+                    runs[run_count] = fdopen(fd, "w+");
+                    struct sort_sink_t spill = {options, runs[run_count++], NULL, NULL, 0, {0}, false};
+                    sort_merge(options, pieces, sort_batch(options, lines, scratch, count, pieces), &spill);
+                    free(spill.prev);
+                    if (fflush(runs[run_count - 1]) == EOF)
+                    {
+                        fprintf(stderr, "-%s: sort: %s\n", sysname, strerror(errno));
+                        goto out;
+                    }
+                    count = 0;
+                }
+                // keep the partial line, growing the buffer for one longer than it
+                memmove(buf, buf + parsed, filled - parsed);
+                filled -= parsed;
+                parsed = 0;
+                if (filled == cap)
+                    buf = realloc(buf, cap *= 2);
+            }
+
+            ssize_t n = read(fds[f], buf + filled, cap - filled);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1)
+                fprintf(stderr, "-%s: sort: %s\n", sysname, strerror(errno));
+            eof = n <= 0;
+            if (n > 0)
+                filled += n;
+
+            char *newline;
+            while (count < max_lines && (newline = memchr(buf + parsed, '\n', filled - parsed)) != NULL)
+            {
+                lines[count].text = buf + parsed;
+                lines[count].len = newline - (buf + parsed);
+                sort_key(options, &lines[count++]);
+                parsed = newline + 1 - buf;
+            }
+            if (eof && parsed < filled) // the last line of a file without a newline
+            {
+                if (count == max_lines)
+                {
+                    eof = false; // spill first, then read the end again
+                    continue;
+                }
+                lines[count].text = buf + parsed;
+                lines[count].len = filled - parsed;
+                sort_key(options, &lines[count++]);
+                parsed = filled;
+            }
+        }
+    }
+
+    // merge the spilled runs with the pieces of the last batch
+    struct sort_source_t *sources = calloc(run_count + SORT_MAX_THREADS, sizeof(struct sort_source_t));
+    int k = sort_batch(options, lines, scratch, count, sources);
+    for (int i = 0; i < run_count; i++, k++)
+    {
+        sources[k].run = runs[i];
+        sources[k].cap = SORT_RUN_BUFFER;
+        sources[k].buf = malloc(SORT_RUN_BUFFER);
+        lseek(fileno(runs[i]), 0, SEEK_SET);
+    }
+    sort_merge(options, sources, k, sink);
+    for (int i = 0; i < k; i++)
+        free(sources[i].buf);
+    free(sources);
+
+out:
+    for (int i = 0; i < run_count; i++)
+        fclose(runs[i]);
+    free(runs);
+    free(lines);
+    free(scratch);
+    free(buf);
+}
+
+/**
+ * Parse a size for -S: a number of bytes with an optional K, M or G suffix
+ * @param  text [description]
+ * @return      the size, 0 if it is not one
+ */
+size_t parse_size(const char *text)
+{
+    char *end;
+    double size = strtod(text, &end);
+    if (end == text || size <= 0)
+        return 0;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    case 'B':
+        end++;
+        break;
+    }
+    return *end == '\0' ? (size_t)size : 0;
+}
+
+/**
+ * The sort builtin: "sort [-nru] [-k N[,M]] [-t c] [-S size] [file...]"
+ * sorts the lines of the files, or of stdin, within a memory budget. When
+ * fused with the uniq stage after it, the sorted lines go to uniq directly.
+ * @param  command [description]
+ * @return         [description]
+ */
+int sort_builtin(struct command_t *command)
+{
+    struct sort_options_t options = {0};
+    options.memory = SORT_DEFAULT_MEMORY;
+    char **files = malloc(sizeof(char *) * (command->arg_count + 1));
+    int file_count = 0;
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        char *arg = command->args[i];
+        if (arg[0] != '-' || arg[1] == '\0')
+        {
+            files[file_count++] = arg;
+            continue;
+        }
+        for (int k = 1; arg[k] != '\0'; k++) // combined flags such as -nr, values attached or in the next argument
+        {
+            char flag = arg[k];
+            if (flag == 'n' || flag == 'r' || flag == 'u')
+            {
+                *(flag == 'n' ? &options.numeric : flag == 'r' ? &options.reverse : &options.unique) = true;
+                continue;
+            }
+            char *value = arg[k + 1] != '\0' ? &arg[k + 1] : i + 1 < command->arg_count ? command->args[++i] : NULL;
+            if ((flag != 'k' && flag != 't' && flag != 'S') || value == NULL)
+            {
+                printf("-%s: sort: invalid option -- '%c'\n", sysname, flag);
+                last_status = 2;
+                free(files);
+                return SUCCESS;
+            }
+            if (flag == 'k')
+            {
+                char *end;
+                options.key_start = strtol(value, &end, 10);
+                options.key_end = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+                for (; *end != '\0'; end++) // per-key n and r apply to the whole sort
+                    if (*end == 'n')
+                        options.numeric = true;
+                    else if (*end == 'r')
+                        options.reverse = true;
+                if (options.key_start < 1)
+                    options.key_start = 1;
+            }
+            else if (flag == 't')
+                options.separator = value[0];
+            else if ((options.memory = parse_size(value)) < SORT_MIN_MEMORY)
+                options.memory = SORT_MIN_MEMORY;
+            break;
+        }
+    }
+    if (file_count == 0)
+        files[file_count++] = command->redirects[0] != NULL ? command->redirects[0] : "-";
+
+    int *fds = malloc(sizeof(int) * file_count);
+    int nfds = 0;
+    for (int i = 0; i < file_count; i++)
+    {
+        int fd = strcmp(files[i], "-") == 0 ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fprintf(stderr, "-%s: sort: %s: %s\n", sysname, files[i], strerror(errno));
+            last_status = 2;
+        }
+        else
+            fds[nfds++] = fd;
+    }
+
+    struct uniq_state uniq;
+    struct sort_sink_t sink = {&options, stdout, NULL, NULL, 0, {0}, false};
+    memset(&uniq, 0, sizeof(uniq));
+    char *uniq_input;
+    if (command->fused != NULL && uniq_parse_options(command->fused, &uniq.options, &uniq_input, true) == 0)
+        sink.uniq = &uniq;
+    if (command->fused == NULL || sink.uniq != NULL)
+        sort_run(&options, fds, nfds, &sink);
+    if (sink.uniq != NULL)
+        uniq_flush(&uniq);
+    fflush(stdout);
+
+    for (int i = 0; i < nfds; i++)
+        if (fds[i] != STDIN_FILENO)
+            close(fds[i]);
+    free(fds);
+    free(files);
+    free(sink.prev);
+    free(uniq.prev);
+    return SUCCESS;
+}
+
+/**
+ * Whether a sort stage can take the uniq stage after it as its sink: uniq
+ * reads nothing but sort's output, and sort's output goes nowhere else
+ * @param  sort [description]
+ * @param  uniq the next stage
+ * @return      [description]
+ */
+bool sort_fusable(struct command_t *sort, struct command_t *uniq)
+{
+    if (strcmp(sort->name, "sort") != 0 || uniq == NULL || strcmp(uniq->name, "uniq") != 0 ||
+        uniq->redirects[0] != NULL)
+        return false;
+    for (int i = 1; i <= 4; i++)
+        if (sort->redirects[i] != NULL)
+            return false;
+    if (sort->stderr_to_stdout || sort->fanout != NULL)
+        return false;
+    for (int i = 0; i < uniq->arg_count; i++) // an input file, or --global, has uniq read something else
+        if (uniq->args[i][0] != '-' || strcmp(uniq->args[i], "--global") == 0 || strcmp(uniq->args[i], "--top") == 0)
+            return false;
+    return true;
+}
+
+/**
+ * Fuse every "sort | uniq" of a pipeline: the uniq becomes its sort's sink
+ * and leaves the pipeline, its output redirections copied onto the sort
+ * @param command first stage of a pipeline
+ */
+void sort_fuse(struct command_t *command)
+{
+    for (; command != NULL; command = command->next)
+    {
+        struct command_t *uniq = command->next;
+        if (command->fused != NULL || !sort_fusable(command, uniq))
+            continue;
+        for (int i = 1; i <= 4; i++)
+            command->redirects[i] = uniq->redirects[i];
+        command->stderr_to_stdout = uniq->stderr_to_stdout;
+        command->fanout = uniq->fanout;
+        command->fused = uniq;
+        command->next = uniq->next;
+    }
+}
+
+/**
+ * wiseman <minutes>: every so many minutes, write a line of wisdom to
+ * /tmp/wisecow.txt. Runs on the shell's own scheduler, so the user's
+ * crontab is left alone and "schedule cancel" stops it.
+ * @param  command [description]
+ * @param  minutes [description]
+ * @return         [description]
+ */
+int wiseman(struct command_t *command, char *minutes)
+{
+    (void)command;
+    uint64_t period;
+    if (minutes == NULL || parse_seconds(minutes, &period) == -1 || period == 0)
+    {
+        printf("Usage: wiseman <minutes>\n");
+        last_status = 2;
+        return SUCCESS;
+    }
+    period *= 60;
+    // fortune says something wiser when it is installed
+    const char *text = lookup_command("fortune") != NULL ? "fortune >> /tmp/wisecow.txt"
+                                                         : "echo 'Wiseman is working' >> /tmp/wisecow.txt";
+    int id = schedule_add(text, period, period);
+    if (id == -1)
+    {
+        printf("-%s: wiseman: too many scheduled commands\n", sysname);
+        last_status = 1;
+    }
+    else
+        printf("Wiseman will speak every %s minutes (schedule %d)\n", minutes, id);
+    return SUCCESS;
+}
+
+int wiseman_builtin(struct command_t *command)
+{
+    return wiseman(command, command->arg_count > 0 ? command->args[0] : NULL);
+}
+
+#define CHAT_MAX_MEMBERS 64                              // members a room can hold
+#define CHAT_MAX_MESSAGE (PIPE_BUF - sizeof(uint32_t))   // so that a whole frame is one atomic pipe write
+#define CHAT_QUEUE_LENGTH 64                             // frames held back for a slow member before dropping
+#define CHAT_STALE_SECONDS 60                            // unreachable members are dropped after this long
+#define CHAT_REPLAY_DEFAULT 10                           // earlier messages shown on joining
+
+struct chat_member_t
+{
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX]; // the member's FIFO
+    int fd;              // kept open for writing, -1 while the member has no reader
+    char *queue[CHAT_QUEUE_LENGTH]; // frames the FIFO had no room for, oldest at queue_head
+    int queue_head;
+    int queued;
+    long dropped; // frames lost because the queue was full
+    time_t unreachable_since; // when writes to the member started failing, 0 while they work
+};
+
+#define CHAT_LOG_SEGMENT_SIZE (16 << 20) // bytes per log segment before moving on to a new one
+#define CHAT_LOG_SEGMENTS 16             // segments kept; older ones are deleted
+#define CHAT_LOG_INDEX_EVERY 64          // records between entries of a segment's index
+
+// A room's log lives in /tmp/<room>/.log/ as segments named after the
+// sequence number of their first record: <seq>.log holds the records and
+// <seq>.idx a sparse index into it. The shared "state" file says where the
+// next record goes and is also the lock writers take.
+
+struct chat_log_record_t // header of each record in a segment, followed by the text
+{
+    uint32_t length;
+    uint64_t time; // nanoseconds since the epoch
+} __attribute__((packed));
+
+struct chat_log_index_t
+{
+    uint64_t seq;
+    uint64_t time;
+    uint64_t offset; // of the record in its segment
+};
+
+struct chat_log_state_t
+{
+    uint64_t next_seq; // sequence number of the next record
+    uint64_t segment;  // first sequence number of the segment being written
+    uint64_t size;     // bytes written to that segment
+};
+
+struct chat_log_t
+{
+    char dir[PATH_MAX];
+    int state_fd; // -1 when the room has no log
+    struct chat_log_state_t *state; // mapped from the state file
+    int segment_fd;                 // the segment this process last appended to
+    int index_fd;
+    uint64_t open_segment;
+};
+
+struct chat_log_segment_t // a segment mapped for reading
+{
+    uint64_t first;
+    const char *data;
+    size_t size;      // bytes of complete records
+    size_t data_size; // bytes mapped
+    const struct chat_log_index_t *index;
+    size_t index_count;
+    size_t index_size;
+};
+
+/**
+ * Path of a file of a log segment
+ * @param log       [description]
+ * @param path      [description]
+ * @param first     first sequence number of the segment
+ * @param extension "log" or "idx"
+ */
+void chat_log_path(struct chat_log_t *log, char *path, uint64_t first, const char *extension)
+{
+    snprintf(path, PATH_MAX, "%.4000s/%016llu.%s", log->dir, (unsigned long long)first, extension);
+}
+
+/**
+ * Open a room's log, creating it if this is the room's first session
+ * @param  log  [description]
+ * @param  room room folder
+ * @return      0, -1 if the room has to do without a log
+ */
+int chat_log_open(struct chat_log_t *log, const char *room)
+{
+    char path[PATH_MAX];
+    log->state_fd = log->segment_fd = log->index_fd = -1;
+    log->open_segment = UINT64_MAX;
+    snprintf(log->dir, sizeof(log->dir), "%.4000s/.log", room);
+    snprintf(path, sizeof(path), "%.4000s/state", log->dir);
+    if (mkdir(log->dir, 0777) == -1 && errno != EEXIST)
+        return -1;
+    log->state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (log->state_fd == -1)
+        return -1;
+    flock(log->state_fd, LOCK_EX);
+    struct stat st;
+    if (fstat(log->state_fd, &st) == 0 && st.st_size < (off_t)sizeof(struct chat_log_state_t))
+        ftruncate(log->state_fd, sizeof(struct chat_log_state_t)); // a new log starts at zero
+    flock(log->state_fd, LOCK_UN);
+    log->state = mmap(NULL, sizeof(struct chat_log_state_t), PROT_READ | PROT_WRITE, MAP_SHARED, log->state_fd, 0);
+    if (log->state == MAP_FAILED)
+    {
+        close(log->state_fd);
+        log->state_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compare two sequence numbers, for qsort
+ * @param  a [description]
+ * @param  b [description]
+ * @return   [description]
+ */
+int compare_seqs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * List the segments of a log, oldest first
+ * @param  log    [description]
+ * @param  firsts receives a malloc'd array of their first sequence numbers
+ * @return        number of segments
+ */
+int chat_log_segments(struct chat_log_t *log, uint64_t **firsts)
+{
+    int count = 0, capacity = 0;
+    *firsts = NULL;
+    DIR *dir = opendir(log->dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        uint64_t first = strtoull(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".log") != 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            *firsts = realloc(*firsts, sizeof(uint64_t) * capacity);
+        }
+        (*firsts)[count++] = first;
+    }
+    if (dir != NULL)
+        closedir(dir);
+    qsort(*firsts, count, sizeof(uint64_t), compare_seqs);
+    return count;
+}
+
+/**
+ * Delete all but the newest CHAT_LOG_SEGMENTS segments
+ * @param log [description]
+ */
+void chat_log_expire(struct chat_log_t *log)
+{
+    uint64_t *firsts;
+    char path[PATH_MAX];
+    int count = chat_log_segments(log, &firsts);
+    for (int i = 0; i < count - CHAT_LOG_SEGMENTS; i++)
+    {
+        chat_log_path(log, path, firsts[i], "log");
+        unlink(path);
+        chat_log_path(log, path, firsts[i], "idx");
+        unlink(path);
+    }
+    free(firsts);
+}
+
+/**
+ * Append a message to the log. Writers from every member's process are
+ * serialised by an flock() on the state file; a segment that would grow
+ * past CHAT_LOG_SEGMENT_SIZE is closed and a new one started.
+ * @param log    [description]
+ * @param text   [description]
+ * @param length [description]
+ */
+void chat_log_append(struct chat_log_t *log, const char *text, uint32_t length)
+{
+    if (log->state_fd == -1)
+        return;
+    struct chat_log_record_t record = {length, 0};
+    struct timespec now;
+
+    flock(log->state_fd, LOCK_EX);
+    clock_gettime(CLOCK_REALTIME, &now); // under the lock, so times never go backwards in the log
+    record.time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    struct chat_log_state_t *state = log->state;
+    if (state->size > 0 && state->size + sizeof(record) + length > CHAT_LOG_SEGMENT_SIZE)
+    {
+        state->segment = state->next_seq;
+        state->size = 0;
+        chat_log_expire(log);
+    }
+    if (log->open_segment != state->segment)
+    {
+        char path[PATH_MAX];
+        if (log->segment_fd != -1)
+        {
+            close(log->segment_fd);
+            close(log->index_fd);
+        }
+        chat_log_path(log, path, state->segment, "log");
+        log->segment_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        chat_log_path(log, path, state->segment, "idx");
+        log->index_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        log->open_segment = state->segment;
+    }
+
+    uint64_t seq = state->next_seq;
+    struct iovec iov[2] = {{&record, sizeof(record)}, {(char *)text, length}};
+    if (log->segment_fd != -1 && pwritev(log->segment_fd, iov, 2, state->size) == (ssize_t)(sizeof(record) + length))
+    {
+        if ((seq - state->segment) % CHAT_LOG_INDEX_EVERY == 0)
+        {
+            struct chat_log_index_t entry = {seq, record.time, state->size};
+            write(log->index_fd, &entry, sizeof(entry));
+        }
+        state->size += sizeof(record) + length;
+        state->next_seq++;
+    }
+    flock(log->state_fd, LOCK_UN);
+}
+
+/**
+ * Map a log file for reading, quietly: segments may expire under us
+ * @param  path   [description]
+ * @param  length set to the size of the file
+ * @return        the mapping, NULL if the file is missing or empty
+ */
+const char *chat_log_mmap(const char *path, size_t *length)
+{
+    *length = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1)
+        return NULL;
+    const char *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        *length = data == MAP_FAILED ? 0 : st.st_size;
+        if (data == MAP_FAILED)
+            data = NULL;
+    }
+    close(fd);
+    return data;
+}
+
+/**
+ * Map a segment and its index for reading
+ * @param  log     [description]
+ * @param  first   first sequence number of the segment
+ * @param  size    bytes of complete records in it
+ * @param  segment [description]
+ * @return         0, -1 if the segment is gone or empty
+ */
+int chat_log_map(struct chat_log_t *log, uint64_t first, size_t size, struct chat_log_segment_t *segment)
+{
+    char path[PATH_MAX];
+    memset(segment, 0, sizeof(struct chat_log_segment_t));
+    segment->first = first;
+    chat_log_path(log, path, first, "log");
+    segment->data = chat_log_mmap(path, &segment->data_size);
+    if (segment->data == NULL)
+        return -1;
+    // a record being written right now is not ours to read yet
+    segment->size = size < segment->data_size ? size : segment->data_size;
+    chat_log_path(log, path, first, "idx");
+    segment->index = (const struct chat_log_index_t *)chat_log_mmap(path, &segment->index_size);
+    segment->index_count = segment->index_size / sizeof(struct chat_log_index_t);
+    return 0;
+}
+
+/**
+ * Unmap a segment mapped by chat_log_map()
+ * @param segment [description]
+ */
+void chat_log_unmap(struct chat_log_segment_t *segment)
+{
+    munmap((void *)segment->data, segment->data_size);
+    if (segment->index != NULL)
+        munmap((void *)segment->index, segment->index_size);
+}
+
+/**
+ * Hand the records of a segment from the first one at or after seq or
+ * time to handle. The sparse index narrows the start down to within
+ * CHAT_LOG_INDEX_EVERY records; only those are stepped through.
+ * @param  segment [description]
+ * @param  seq     first sequence number wanted
+ * @param  time    first time wanted, in nanoseconds since the epoch
+ * @param  handle  [description]
+ * @param  arg     passed on to handle
+ * @return         records handed over
+ */
+long chat_log_emit(struct chat_log_segment_t *segment, uint64_t seq, uint64_t time,
+                   void (*handle)(const char *, uint32_t, void *), void *arg)
+{
+    size_t low = 0, high = segment->index_count;
+    while (low < high) // first index entry past the start
+    {
+        size_t mid = (low + high) / 2;
+        bool before = time ? segment->index[mid].time < time : segment->index[mid].seq <= seq;
+        if (before)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    uint64_t current = low ? segment->index[low - 1].seq : segment->first;
+    size_t offset = low ? segment->index[low - 1].offset : 0;
+
+    long emitted = 0;
+    struct chat_log_record_t record;
+    while (offset + sizeof(record) <= segment->size)
+    {
+        memcpy(&record, segment->data + offset, sizeof(record));
+        if (offset + sizeof(record) + record.length > segment->size)
+            break;
+        if (current >= seq && record.time >= time)
+        {
+            handle(segment->data + offset + sizeof(record), record.length, arg);
+            emitted++;
+        }
+        offset += sizeof(record) + record.length;
+        current++;
+    }
+    return emitted;
+}
+
+/**
+ * Replay the log: the last count messages, or with count -1 everything
+ * since time
+ * @param  log    [description]
+ * @param  count  [description]
+ * @param  time   nanoseconds since the epoch
+ * @param  handle [description]
+ * @param  arg    passed on to handle
+ * @return        messages replayed
+ */
+long chat_log_replay(struct chat_log_t *log, long count, uint64_t time,
+                     void (*handle)(const char *, uint32_t, void *), void *arg)
+{
+    if (log->state_fd == -1)
+        return 0;
+    flock(log->state_fd, LOCK_SH);
+    struct chat_log_state_t state = *log->state;
+    flock(log->state_fd, LOCK_UN);
+
+    uint64_t seq = 0;
+    if (count >= 0)
+    {
+        seq = state.next_seq > (uint64_t)count ? state.next_seq - count : 0;
+        time = 0;
+    }
+
+    uint64_t *firsts;
+    int segments = chat_log_segments(log, &firsts);
+    int start = 0;
+    for (int i = segments - 1; i > 0 && start == 0; i--)
+    {
+        // the start is in the newest segment beginning at or before it
+        if (count >= 0 && firsts[i] <= seq)
+            start = i;
+        if (count < 0)
+        {
+            char path[PATH_MAX];
+            struct chat_log_record_t first = {0, 0};
+            chat_log_path(log, path, firsts[i], "log");
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd != -1 && pread(fd, &first, sizeof(first), 0) == sizeof(first) && first.time <= time)
+                start = i;
+            if (fd != -1)
+                close(fd);
+        }
+    }
+
+    long replayed = 0;
+    for (int i = start; i < segments && firsts[i] <= state.segment; i++)
+    {
+        struct chat_log_segment_t segment;
+        size_t size = firsts[i] == state.segment ? state.size : SIZE_MAX;
+        if (chat_log_map(log, firsts[i], size, &segment) == -1)
+            continue; // expired while we were looking
+        replayed += chat_log_emit(&segment, seq, time, handle, arg);
+        chat_log_unmap(&segment);
+    }
+    free(firsts);
+    return replayed;
+}
+
+#define CHAT_SHM_SLOTS 1024         // messages a shared-memory room holds before wrapping
+#define CHAT_SHM_MAGIC 0x73686c78   // set once a ring is initialised
+#define CHAT_SHM_CLOSED 0x636c6f73  // set by the last member out, just before it unlinks the ring
+#define CHAT_SHM_PATIENCE 10000     // yields a sender waits for the sender a lap before it
+
+// With --shm a room is a POSIX shared-memory ring instead of a FIFO per
+// member. Senders take a ticket from head and fill that slot; readers
+// follow the ring at their own pace and sleep on a futex when they catch
+// up. A broadcast is one copy and at most one wake-up, however many
+// members there are. Every member holds a shared flock on the ring for as
+// long as it is in the room, so the one that can take it exclusively on
+// the way out knows it is the last and removes the ring.
+
+struct chat_shm_slot_t
+{
+    _Atomic uint64_t seq; // ticket + 1 once the slot holds that message, 0 while it is written
+    uint32_t length;
+    char text[CHAT_MAX_MESSAGE];
+};
+
+struct chat_shm_ring_t
+{
+    _Atomic uint32_t magic;
+    _Atomic uint64_t head;    // next ticket
+    _Atomic uint32_t wakeup;  // futex word, bumped on every message
+    _Atomic uint32_t waiters; // readers asleep on wakeup
+    struct chat_shm_slot_t slots[CHAT_SHM_SLOTS];
+};
+
+/**
+ * Attach to the ring of a room, creating it if this is the first member
+ * @param  name name of the room
+ * @param  lock set to the ring's descriptor, share-locked while we are a member
+ * @return      the mapped ring, NULL on failure
+ */
+struct chat_shm_ring_t *chat_shm_open(const char *name, int *lock)
+{
+    char path[NAME_MAX + 1];
+    snprintf(path, sizeof(path), "/shellax-%.200s", name);
+retry:;
+    bool creator = true;
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1 && errno == EEXIST)
+    {
+        creator = false;
+        fd = shm_open(path, O_RDWR, 0666);
+    }
+    if (fd == -1)
+    {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (creator && ftruncate(fd, sizeof(struct chat_shm_ring_t)) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    // a member racing the creator waits for the ring to take its size
+    struct stat st;
+    for (int tries = 0; !creator && fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(struct chat_shm_ring_t); tries++)
+    {
+        if (tries == 1000)
+        {
+            close(fd);
+            return NULL;
+        }
+        usleep(1000);
+    }
+    struct chat_shm_ring_t *ring = mmap(NULL, sizeof(struct chat_shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (creator)
+        atomic_store(&ring->magic, CHAT_SHM_MAGIC); // the new mapping is zeroed: head 0, every slot empty
+    while (atomic_load(&ring->magic) == 0)
+        usleep(1000);
+
+    // the last member may have been on its way out as we opened the ring; then start a new one
+    flock(fd, LOCK_SH);
+    if (atomic_load(&ring->magic) != CHAT_SHM_MAGIC)
+    {
+        munmap(ring, sizeof(struct chat_shm_ring_t));
+        close(fd);
+        goto retry;
+    }
+    *lock = fd;
+    return ring;
+}
+
+/**
+ * Leave a room's ring, removing it if nobody else is in the room. The
+ * mapping itself stays until the process exits, as a reader thread may
+ * still be on it.
+ * @param name name of the room
+ * @param ring [description]
+ * @param lock the descriptor chat_shm_open handed back
+ */
+void chat_shm_close(const char *name, struct chat_shm_ring_t *ring, int lock)
+{
+    // members that died without leaving dropped their lock with their descriptors
+    if (flock(lock, LOCK_EX | LOCK_NB) == 0)
+    {
+        char path[NAME_MAX + 1];
+        snprintf(path, sizeof(path), "/shellax-%.200s", name);
+        atomic_store(&ring->magic, CHAT_SHM_CLOSED);
+        shm_unlink(path);
+    }
+    close(lock);
+}
+
+/**
+ * Put a message in the ring and wake the readers. Several senders can
+ * publish at once; each owns the slot of the ticket it drew.
+ * @param ring   [description]
+ * @param text   [description]
+ * @param length [description]
+ */
+void chat_shm_publish(struct chat_shm_ring_t *ring, const char *text, uint32_t length)
+{
+    uint64_t ticket = atomic_fetch_add(&ring->head, 1);
+    struct chat_shm_slot_t *slot = &ring->slots[ticket % CHAT_SHM_SLOTS];
+    // a sender that lapped the ring waits for the one still filling this
+    // slot, or their copies would interleave under a single seq; one that
+    // never finishes died mid-copy
+    uint64_t previous = ticket >= CHAT_SHM_SLOTS ? ticket - CHAT_SHM_SLOTS + 1 : 0;
+    for (int tries = 0; tries < CHAT_SHM_PATIENCE && atomic_load_explicit(&slot->seq, memory_order_acquire) < previous; tries++)
+        sched_yield();
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed); // readers still on the old message see it change
+    atomic_thread_fence(memory_order_release);
+    slot->length = length;
+    memcpy(slot->text, text, length);
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+
+    atomic_fetch_add(&ring->wakeup, 1);
+    if (atomic_load(&ring->waiters) > 0)
+        syscall(SYS_futex, &ring->wakeup, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Hand every message from ticket *next on to handle. A reader that fell a
+ * whole ring behind skips to the oldest message still there and counts
+ * the ones it lost.
+ * @param  ring    [description]
+ * @param  next    ticket of the next message to read, advanced
+ * @param  handle  [description]
+ * @param  arg     passed on to handle
+ * @param  dropped incremented by the messages lost
+ * @return         messages handed over
+ */
+long chat_shm_drain(struct chat_shm_ring_t *ring, uint64_t *next,
+                    void (*handle)(const char *, uint32_t, void *), void *arg, long *dropped)
+{
+    char text[CHAT_MAX_MESSAGE];
+    long count = 0;
+    while (1)
+    {
+        uint64_t head = atomic_load(&ring->head);
+        if (head > *next + CHAT_SHM_SLOTS)
+        {
+            *dropped += head - CHAT_SHM_SLOTS - *next;
+            *next = head - CHAT_SHM_SLOTS;
+        }
+        struct chat_shm_slot_t *slot = &ring->slots[*next % CHAT_SHM_SLOTS];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != *next + 1)
+        {
+            if (seq > *next + 1) // overwritten by a later lap
+            {
+                (*dropped)++;
+                (*next)++;
+                continue;
+            }
+            return count; // not written yet
+        }
+        uint32_t length = slot->length < CHAT_MAX_MESSAGE ? slot->length : CHAT_MAX_MESSAGE;
+        memcpy(text, slot->text, length);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue; // a sender lapped us while we copied; the check above will skip it
+        (*next)++;
+        handle(text, length, arg);
+        count++;
+    }
+}
+
+/**
+ * Sleep until a message past ticket next is published or the timeout
+ * expires
+ * @param ring    [description]
+ * @param next    [description]
+ * @param timeout milliseconds, -1 for no limit
+ */
+void chat_shm_wait(struct chat_shm_ring_t *ring, uint64_t next, int timeout)
+{
+    uint32_t wakeup = atomic_load(&ring->wakeup);
+    if (atomic_load(&ring->head) > next)
+        return;
+    struct timespec limit = {timeout / 1000, (timeout % 1000) * 1000000L};
+    atomic_fetch_add(&ring->waiters, 1);
+    syscall(SYS_futex, &ring->wakeup, FUTEX_WAIT, wakeup, timeout < 0 ? NULL : &limit, NULL, 0);
+    atomic_fetch_sub(&ring->waiters, 1);
+}
+
+struct chat_room_t
+{
+    const char *name;
+    const char *user;
+    char dir[PATH_MAX];  // /tmp/<room>
+    char fifo[PATH_MAX]; // this user's FIFO
+    struct chat_member_t members[CHAT_MAX_MEMBERS];
+    int member_count;
+    int inotify; // watches the room folder for members coming and going, -1 if unavailable
+    struct chat_log_t log;
+    struct chat_shm_ring_t *ring; // the room's shared-memory ring with --shm, else NULL
+    int ring_lock;                // the ring's descriptor, holding our share of its lock
+    uint64_t next;                // ticket of the next message to read from the ring
+};
+
+/**
+ * Add a member to the room's broadcast set
+ * @param  room [description]
+ * @param  name [description]
+ * @return      the member, NULL if the room is full
+ */
+struct chat_member_t *chat_add_member(struct chat_room_t *room, const char *name)
+{
+    for (int i = 0; i < room->member_count; i++)
+        if (strcmp(room->members[i].name, name) == 0)
+            return &room->members[i];
+    if (room->member_count == CHAT_MAX_MEMBERS)
+        return NULL;
+    struct chat_member_t *member = &room->members[room->member_count];
+    memset(member, 0, sizeof(struct chat_member_t));
+    snprintf(member->name, sizeof(member->name), "%s", name);
+    if (snprintf(member->path, sizeof(member->path), "%s/%s", room->dir, name) >= (int)sizeof(member->path))
+        return NULL;
+    member->fd = -1;
+    room->member_count++;
+    return member;
+}
+
+/**
+ * Take a member out of the broadcast set, dropping anything queued for it
+ * @param room  [description]
+ * @param index [description]
+ */
+void chat_remove_member(struct chat_room_t *room, int index)
+{
+    struct chat_member_t *member = &room->members[index];
+    if (member->fd != -1)
+        close(member->fd);
+    for (int i = 0; i < member->queued; i++)
+        free(member->queue[(member->queue_head + i) % CHAT_QUEUE_LENGTH]);
+    room->member_count--;
+    if (index != room->member_count)
+        *member = room->members[room->member_count];
+}
+
+/**
+ * Apply the membership changes inotify reports for the room folder. A new
+ * or reopened FIFO adds its member; a removed or renamed one drops it.
+ * Names starting with a dot are not members.
+ * @param room [description]
+ */
+void chat_update_members(struct chat_room_t *room)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(room->inotify, events, sizeof(events))) > 0)
+    {
+        for (char *p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len == 0 || event->name[0] == '.' || (event->mask & IN_ISDIR))
+                continue;
+            if (event->mask & (IN_CREATE | IN_OPEN | IN_MOVED_TO))
+            {
+                struct chat_member_t *member = chat_add_member(room, event->name);
+                if (member != NULL && (event->mask & IN_OPEN))
+                    member->unreachable_since = 0; // someone is (re)attaching to it
+            }
+            else
+            {
+                for (int i = 0; i < room->member_count; i++)
+                    if (strcmp(room->members[i].name, event->name) == 0)
+                        chat_remove_member(room, i);
+            }
+        }
+    }
+}
+
+/**
+ * Drop members nobody has been reading for CHAT_STALE_SECONDS, such as users
+ * whose chatroom was killed. They come back when their FIFO is opened again.
+ * @param room [description]
+ */
+void chat_drop_stale(struct chat_room_t *room)
+{
+    time_t now = time(NULL);
+    for (int i = room->member_count - 1; i >= 0; i--)
+    {
+        struct chat_member_t *member = &room->members[i];
+        if (member->unreachable_since != 0 && now - member->unreachable_since > CHAT_STALE_SECONDS)
+            chat_remove_member(room, i);
+    }
+}
+
+/**
+ * Write a length prefix and payload to a member with one writev(), opening
+ * its FIFO first if needed
+ * @param  member [description]
+ * @param  iov    the length prefix and the payload
+ * @return        1 if written, 0 if the FIFO is full or has no reader
+ */
+int chat_write_member(struct chat_member_t *member, struct iovec *iov)
+{
+    // ENXIO: nobody has the FIFO open for reading
+    if (member->fd == -1)
+        member->fd = open(member->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (member->fd != -1 && writev(member->fd, iov, 2) != -1)
+    {
+        member->unreachable_since = 0;
+        return 1;
+    }
+    if (member->fd != -1 && errno == EPIPE) // the reader went away; reopen on the next attempt
+    {
+        close(member->fd);
+        member->fd = -1;
+    }
+    if (member->fd == -1 && member->unreachable_since == 0)
+        member->unreachable_since = time(NULL);
+    return 0; // EAGAIN alone is a slow reader, not a missing one
+}
+
+/**
+ * Write one frame to a member without blocking. Frames are at most
+ * PIPE_BUF bytes, so the kernel either takes all of it or none of it.
+ * @param  member [description]
+ * @param  frame  a 32-bit length followed by the payload
+ * @return        1 if written, 0 if the FIFO is full or has no reader
+ */
+int chat_write_frame(struct chat_member_t *member, const char *frame)
+{
+    uint32_t length;
+    memcpy(&length, frame, sizeof(length));
+    struct iovec iov[2] = {{(char *)frame, sizeof(length)}, {(char *)frame + sizeof(length), length}};
+    return chat_write_member(member, iov);
+}
+
+/**
+ * Send as many queued frames to a member as its FIFO takes, oldest first
+ * @param member [description]
+ */
+void chat_flush_member(struct chat_member_t *member)
+{
+    while (member->queued > 0 && chat_write_frame(member, member->queue[member->queue_head]))
+    {
+        free(member->queue[member->queue_head]);
+        member->queue_head = (member->queue_head + 1) % CHAT_QUEUE_LENGTH;
+        member->queued--;
+    }
+}
+
+/**
+ * Send a message to every member of the room from this one process. The
+ * length prefix and the text go out in a single writev(); a member whose
+ * FIFO is full or not open gets the frame queued, and once its queue is
+ * full the oldest frame is dropped so a stalled reader cannot hold up the
+ * rest of the room.
+ * @param room [description]
+ * @param text [description]
+ */
+void chat_broadcast(struct chat_room_t *room, const char *text)
+{
+    uint32_t length = strlen(text);
+    if (length > CHAT_MAX_MESSAGE)
+        length = CHAT_MAX_MESSAGE;
+    struct iovec iov[2] = {{&length, sizeof(length)}, {(char *)text, length}};
+
+    for (int i = 0; i < room->member_count; i++)
+    {
+        struct chat_member_t *member = &room->members[i];
+        chat_flush_member(member);
+        if (member->queued == 0 && chat_write_member(member, iov))
+            continue;
+
+        if (member->queued == CHAT_QUEUE_LENGTH)
+        {
+            free(member->queue[member->queue_head]);
+            member->queue_head = (member->queue_head + 1) % CHAT_QUEUE_LENGTH;
+            member->queued--;
+            member->dropped++;
+        }
+        char *frame = malloc(sizeof(length) + length);
+        memcpy(frame, &length, sizeof(length));
+        memcpy(frame + sizeof(length), text, length);
+        member->queue[(member->queue_head + member->queued++) % CHAT_QUEUE_LENGTH] = frame;
+    }
+}
+
+/**
+ * Frame handler that prints the message
+ * @param text   [description]
+ * @param length [description]
+ * @param arg    [description]
+ */
+void chat_print_frame(const char *text, uint32_t length, void *arg)
+{
+    (void)arg;
+    printf("%.*s\n", (int)length, text);
+}
+
+/**
+ * Hand every complete frame in a receive buffer to handle and keep the
+ * incomplete rest at its front
+ * @param  buf    [description]
+ * @param  length bytes in buf
+ * @param  handle [description]
+ * @param  arg    passed on to handle
+ * @return        bytes left in buf
+ */
+size_t chat_read_frames(char *buf, size_t length, void (*handle)(const char *, uint32_t, void *), void *arg)
+{
+    size_t offset = 0;
+    uint32_t size;
+    while (length - offset >= sizeof(size))
+    {
+        memcpy(&size, buf + offset, sizeof(size));
+        if (length - offset - sizeof(size) < size)
+            break;
+        handle(buf + offset + sizeof(size), size, arg);
+        offset += sizeof(size) + size;
+    }
+    memmove(buf, buf + offset, length - offset);
+    return length - offset;
+}
 
-    char pathOfCommand[50];
-    const char s[2] = ":";
+/**
+ * Send a formatted "[room] user: text" message over the room's transport,
+ * appending it to the room log first if it is part of the room's history
+ * @param room   [description]
+ * @param text   [description]
+ * @param logged false for traffic that is not (benchmark messages)
+ */
+void chat_deliver(struct chat_room_t *room, const char *text, bool logged)
+{
+    char message[CHAT_MAX_MESSAGE + 1];
+    if (snprintf(message, sizeof(message), "[%s] %s: %s", room->name, room->user, text) < 0)
+        return;
+    size_t length = strlen(message);
+    if (length > CHAT_MAX_MESSAGE)
+        length = CHAT_MAX_MESSAGE;
+    if (logged)
+        chat_log_append(&room->log, message, length);
+    if (room->ring != NULL)
+        chat_shm_publish(room->ring, message, length);
+    else
+        chat_broadcast(room, message); // overlong messages are cut at CHAT_MAX_MESSAGE
+}
 
-    char *token;
+/**
+ * Send a message to the room and keep it in the room log
+ * @param room [description]
+ * @param text [description]
+ */
+void chat_send(struct chat_room_t *room, const char *text)
+{
+    chat_deliver(room, text, true);
+}
 
-    token = strtok(path, s); // divide into tokens to search into every directory
+/**
+ * The chatroom event loop: wait on stdin, this user's FIFO and any member
+ * with frames queued for it at once, so typing never holds up incoming
+ * messages and a quiet room never holds up sending.
+ * @param  room [description]
+ * @param  fifo this user's FIFO, open for reading
+ * @return      [description]
+ */
+int chat_loop(struct chat_room_t *room, int fifo)
+{
+    char received[2 * PIPE_BUF];
+    size_t pending = 0;
+    char typed[CHAT_MAX_MESSAGE + 1];
+    size_t typed_length = 0;
+    struct pollfd fds[3 + CHAT_MAX_MEMBERS];
+    bool stdin_open = true;
+
+    printf("%s write your message here:\n", room->user);
+    fflush(stdout);
+    while (stdin_open)
+    {
+        int nfds = 0, retry = -1;
+        fds[nfds++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+        fds[nfds++] = (struct pollfd){.fd = fifo, .events = POLLIN};
+        fds[nfds++] = (struct pollfd){.fd = room->inotify, .events = POLLIN}; // ignored while -1
+        for (int i = 0; i < room->member_count; i++)
+        {
+            if (room->members[i].queued == 0)
+                continue;
+            if (room->members[i].fd == -1)
+                retry = 1000; // no reader yet: try opening again in a second
+            else
+                fds[nfds++] = (struct pollfd){.fd = room->members[i].fd, .events = POLLOUT};
+        }
 
-    DIR *pDir;
-    struct dirent *entry;
+        if (poll(fds, nfds, retry) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
 
-    while (token != NULL) // keep reading until there are no directories left
-    {
-        pDir = opendir(token); // open the current directory
+        if (fds[2].revents & POLLIN)
+            chat_update_members(room);
 
-        if (pDir == NULL)
+        if (fds[1].revents & POLLIN)
         {
-            // return 1;
+            ssize_t n;
+            while ((n = read(fifo, received + pending, sizeof(received) - pending)) > 0)
+                pending = chat_read_frames(received, pending + n, chat_print_frame, NULL);
         }
-        else
+
+        if (fds[0].revents & (POLLIN | POLLHUP))
         {
-            while ((entry = readdir(pDir)) != NULL) // read the entries in the current directory
+            ssize_t n = read(STDIN_FILENO, typed + typed_length, sizeof(typed) - 1 - typed_length);
+            if (n <= 0)
+                stdin_open = false;
+            else
+                typed_length += n;
+
+            // send every complete line; a line too long for one frame is sent as it is
+            char *newline;
+            while ((newline = memchr(typed, '\n', typed_length)) != NULL ||
+                   typed_length == sizeof(typed) - 1 || (!stdin_open && typed_length > 0))
             {
-                if (strcmp(entry->d_name, command->name) == 0) // the path of the command is found
-                {
-                    strcpy(pathOfCommand, "");
-                    strcpy(pathOfCommand, token);
-                    strcat(pathOfCommand, "/");
-                    strcat(pathOfCommand, command->name);
-                    execv(pathOfCommand, command->args); // call execv() wiht the path of the command and the arguments received from the user
-                    exit(0);
-                    break;
-                }
+                size_t line = newline ? (size_t)(newline - typed) : typed_length;
+                typed[line] = '\0';
+                chat_send(room, typed);
+                size_t used = newline ? line + 1 : line;
+                memmove(typed, typed + used, typed_length - used);
+                typed_length -= used;
             }
         }
 
-        token = strtok(NULL, s); // read the next one
+        for (int i = 0; i < room->member_count; i++)
+            if (room->members[i].queued > 0)
+                chat_flush_member(&room->members[i]);
+        chat_drop_stale(room);
+        fflush(stdout);
     }
+    return 0;
 }
 
-void ourUniq(char *input)
+/**
+ * Set a room up for user: create the room folder if it is not there yet
+ * and open the room's log
+ * @param  room [description]
+ * @param  name name of the room
+ * @param  user [description]
+ * @return      0, -1 on failure
+ */
+int chat_open_room(struct chat_room_t *room, const char *name, const char *user)
 {
-    const char s[2] = "\n";
-    char *token;
-    token = strtok(input, s); // get each token separated by a newline
+    room->name = name;
+    room->user = user;
+    room->member_count = 0;
+    snprintf(room->dir, sizeof(room->dir), "/tmp/%s", name); // name of the chatroom -> name of the folder that we keep the users
+    if (snprintf(room->fifo, sizeof(room->fifo), "%s/%s", room->dir, user) >= (int)sizeof(room->fifo))
+    {
+        printf("Chatroom or user name is too long\n");
+        return -1;
+    }
 
-    char visited[100][100]; // keep an array of strings to keep the words encountered for the first time
-    int i = 0;
-    strcpy(visited[i], token); // the first word read from the input should be added to the array
+    signal(SIGPIPE, SIG_IGN); // a member leaving shows up as EPIPE instead
+
+    // the room is a folder holding a named pipe per user; both may exist from earlier sessions
+    if (mkdir(room->dir, 0777) == -1 && errno != EEXIST)
+    {
+        printf("Failed to create %s: %s\n", room->dir, strerror(errno));
+        return -1;
+    }
+    chat_log_open(&room->log, room->dir); // without a log the room still works, it just forgets
+    room->inotify = -1;
+    room->ring = NULL;
+    return 0;
+}
 
-    int exists = 0; // initially exists set to 0 meaning the word is not encountered yet
+/**
+ * Join a room as user through the shared-memory ring
+ * @param  room [description]
+ * @param  name name of the room
+ * @param  user [description]
+ * @return      0, -1 on failure
+ */
+int chat_join_shm(struct chat_room_t *room, const char *name, const char *user)
+{
+    if (chat_open_room(room, name, user) == -1)
+        return -1;
+    room->ring = chat_shm_open(name, &room->ring_lock);
+    if (room->ring == NULL)
+        return -1;
+    room->next = atomic_load(&room->ring->head);
+    return 0;
+}
 
-    while (token != NULL) // keep reading the input
+/**
+ * Join a room as user: create the room folder and the user's FIFO if they
+ * are not there yet, start watching the folder and take the members already
+ * in it
+ * @param  room [description]
+ * @param  name name of the room
+ * @param  user [description]
+ * @return      the user's FIFO open for reading, -1 on failure
+ */
+int chat_join(struct chat_room_t *room, const char *name, const char *user)
+{
+    if (chat_open_room(room, name, user) == -1)
+        return -1;
+    if (mkfifo(room->fifo, 0777) == -1 && errno != EEXIST)
     {
-        for (int k = 0; k < i; k++)
-        {
-            if (strcmp(visited[k], token) == 0) // current token is a duplicate, so we will not add it to the visited array
-            {
-                exists = 1; // this word is previously encountered
-            }
-        }
-        if (exists == 0) // first encounter of this word, so will be add to the array
-        {
-            strcpy(visited[i], token);
-            i++;
-        }
-        token = strtok(NULL, s); // read the next one
-        exists = 0;              // reset the exists variable
+        printf("Failed to pipe\n");
+        return -1;
     }
 
-    for (int m = 0; m < i; m++) // print the elements from the array with no duplicates
+    // watch before listing, so that nobody joining in between is missed
+    room->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (room->inotify != -1 &&
+        inotify_add_watch(room->inotify, room->dir, IN_CREATE | IN_OPEN | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) == -1)
     {
-        printf("%s\n", visited[m]);
+        close(room->inotify);
+        room->inotify = -1;
     }
+    DIR *dir = opendir(room->dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.' && (entry->d_type == DT_FIFO || entry->d_type == DT_UNKNOWN))
+            chat_add_member(room, entry->d_name);
+    if (dir != NULL)
+        closedir(dir);
+
+    // the FIFO stays open for the whole session; opening it for writing as
+    // well means it never reports end of file while the room is quiet
+    int fifo = open(room->fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fifo == -1)
+        printf("Failed to open %s: %s\n", room->fifo, strerror(errno));
+    return fifo;
 }
 
-void ourUniqWithCount(char *input)
+#define CHAT_BENCH_SECONDS 10 // default length of a chatroom benchmark
+#define CHAT_BENCH_GRACE 1    // seconds members keep reading after the last send
+
+struct chat_bench_member_t
 {
-    const char s[2] = "\n";
-    char *token;
-    token = strtok(input, s); // get each token separated by a newline
+    uint64_t *latencies; // nanoseconds from send to receipt of each delivered message
+    long count;
+    long capacity;
+    long sent;
+    long received;
+};
 
-    char visited[100][100]; // keep an array of strings to keep the words encountered for the first time
-    int visitedCount[100];  // will keep the count in an array
-    int i = 0;
-    strcpy(visited[i], token); // the first word read from the input should be added to the array
+struct chat_bench_report_t // what each simulated member sends back to the benchmark
+{
+    long sent;
+    long received;
+    long dropped; // frames it gave up on because a member's queue was full
+    long queued;  // frames still queued when it stopped
+    long count;   // latencies that follow
+};
+
+/**
+ * Frame handler of a simulated member: record the latency of benchmark
+ * messages, which carry their send time
+ * @param text   [description]
+ * @param length [description]
+ * @param arg    the member's statistics
+ */
+void chat_bench_frame(const char *text, uint32_t length, void *arg)
+{
+    struct chat_bench_member_t *stats = arg;
+    const char *mark = memrchr(text, ' ', length); // "[room] user: bench <time>"
+    if (mark == NULL || mark - text < 5 || memcmp(mark - 5, "bench", 5) != 0)
+        return;
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%.*s", (int)(text + length - mark - 1), mark + 1);
+    uint64_t sent = strtoull(digits, NULL, 10);
+    if (stats->count == stats->capacity)
+    {
+        stats->capacity = stats->capacity ? stats->capacity * 2 : 4096;
+        stats->latencies = realloc(stats->latencies, sizeof(uint64_t) * stats->capacity);
+    }
+    stats->latencies[stats->count++] = monotonic_ns() - sent;
+    stats->received++;
+}
 
-    int exists = 0; // initially exists set to 0 meaning the word is not encountered yet
+/**
+ * One simulated member: join the room, wait for everybody to be in it and
+ * for the start signal, send timestamped messages every interval until the
+ * deadline, then report to the benchmark through out
+ * @param room_name [description]
+ * @param user      [description]
+ * @param users     members to wait for
+ * @param interval  nanoseconds between messages
+ * @param seconds   [description]
+ * @param ready     written once the member is ready
+ * @param start     reaches end of file when the benchmark starts
+ * @param out       [description]
+ */
+void chat_bench_member(const char *room_name, const char *user, int users, uint64_t interval, int seconds,
+                       bool shm, int ready, int start, int out)
+{
+    static struct chat_room_t room;
+    struct chat_bench_member_t stats = {0};
+    char received[2 * PIPE_BUF];
+    size_t pending = 0;
+    long missed = 0;
+    int fifo = shm ? chat_join_shm(&room, room_name, user) : chat_join(&room, room_name, user);
+    if (fifo == -1)
+        exit(1);
+
+    // every simulated member must see the others before the clock starts
+    while (!shm)
+    {
+        int seen = 0;
+        for (int i = 0; i < room.member_count; i++)
+            seen += strncmp(room.members[i].name, "bench", 5) == 0;
+        if (seen >= users)
+            break;
+        struct pollfd fds = {.fd = room.inotify, .events = POLLIN};
+        if (room.inotify == -1 || poll(&fds, 1, 1000) <= 0)
+            break;
+        chat_update_members(&room);
+    }
+    write(ready, "", 1);
+    char c;
+    read(start, &c, 1);
 
-    while (token != NULL) // keep reading the input
+    uint64_t now = monotonic_ns();
+    uint64_t next = now + (uint64_t)(drand48() * interval); // spread the senders out
+    uint64_t stop = now + (uint64_t)seconds * 1000000000;
+    uint64_t deadline = stop + (uint64_t)CHAT_BENCH_GRACE * 1000000000;
+    while ((now = monotonic_ns()) < deadline)
     {
-        for (int k = 0; k < i; k++)
+        if (now >= next && now < stop)
         {
-            if (strcmp(visited[k], token) == 0) // current token is a duplicate, so we will not add it to the visited array
-            {
-                exists = 1;        // this word is previously encountered
-                visitedCount[k]++; // increment the corresponding index in the visitedCount array
-            }
+            char message[64];
+            snprintf(message, sizeof(message), "bench %llu", (unsigned long long)now);
+            chat_deliver(&room, message, false); // measure the transport, and keep the room's history clean
+            stats.sent++;
+            next += interval;
         }
-        if (exists == 0) // first encounter of this word, so will be add to the array
+
+        // a sender falling behind the rate still reads between sends
+        uint64_t wake = now < stop ? next : deadline;
+        int timeout = wake > now ? (int)((wake - now) / 1000000) + 1 : 0;
+        if (shm)
         {
-            strcpy(visited[i], token);
-            visitedCount[i] = 1; // count is 1
-            i++;
+            chat_shm_drain(room.ring, &room.next, chat_bench_frame, &stats, &missed);
+            if (timeout > 0)
+                chat_shm_wait(room.ring, room.next, timeout);
+            continue;
         }
-        token = strtok(NULL, s); // read the next one
-        exists = 0;              // reset the exists variable
+        struct pollfd fds = {.fd = fifo, .events = POLLIN};
+        poll(&fds, 1, timeout);
+        ssize_t n;
+        while ((n = read(fifo, received + pending, sizeof(received) - pending)) > 0)
+            pending = chat_read_frames(received, pending + n, chat_bench_frame, &stats);
+        for (int i = 0; i < room.member_count; i++)
+            if (room.members[i].queued > 0)
+                chat_flush_member(&room.members[i]);
     }
 
-    for (int m = 0; m < i; m++) // print the elements from the array with no duplicates and the corresponding counts
+    struct chat_bench_report_t report = {stats.sent, stats.received, missed, 0, stats.count};
+    for (int i = 0; i < room.member_count; i++)
     {
-        printf("%d %s\n", visitedCount[m], visited[m]);
+        report.dropped += room.members[i].dropped;
+        report.queued += room.members[i].queued;
     }
+    write(out, &report, sizeof(report));
+    for (long done = 0; done < stats.count;)
+    {
+        ssize_t n = write(out, stats.latencies + done, sizeof(uint64_t) * (stats.count - done));
+        if (n <= 0)
+            break;
+        done += n / sizeof(uint64_t);
+    }
+    if (shm)
+        chat_shm_close(room.name, room.ring, room.ring_lock);
+    else
+        unlink(room.fifo);
+    exit(0);
 }
 
-int wiseman(struct command_t *command, char *minutes)
+/**
+ * Compare two latencies, for qsort
+ * @param  a [description]
+ * @param  b [description]
+ * @return   [description]
+ */
+int compare_latencies(const void *a, const void *b)
 {
-    // str will appends the input "minutes" to the cronjob to be scheduled
-    char str[150];
-    strcpy(str, "echo '*/");
-    strcat(str, minutes);
-    strcat(str, " * * * * /tmp/com.sh' | crontab -");
-    // system("echo 'echo | fortune | cowsay >>/tmp/wisecow.txt' >/tmp/com.sh"); //does not work for some reason
-    //  instead it writes "Wiseman is working" to /tmp/wisecow.txt periodically
-    system("echo 'echo 'Wiseman is working' >>/tmp/wisecow.txt' >/tmp/com.sh");
-    system("chmod a+x /tmp/com.sh"); // make the com.sh executable
-    system(str);                     // schedule the cron job
-    return SUCCESS;
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
 }
 
-void chatroom(struct command_t *command)
+/**
+ * chatroom --bench [--shm] <room> <users> <rate> [seconds]: load the room
+ * with simulated members sending rate messages per second between them, and
+ * report delivered throughput, losses and end-to-end latency percentiles
+ * @param  command [description]
+ * @return         [description]
+ */
+int chat_bench(struct command_t *command)
 {
-    printf("Chatroom name: %s\n", command->args[0]);
-    printf("User: %s\n", command->args[1]);
-
-    // these variables will be used to decide whether to create a new chatroom and/or a new user by checking already existing chatrooms and users
-    int chatroomExist = 0;
-    int userExist = 0;
-
-    char chatroomName[50];
-    char userName[50];
-
-    int numberOfUser = 0; // keeping the number of users in a chatroom
-
-    DIR *chatroomPtr;
-    DIR *userPtr;
-    DIR *userPtr2;
-    DIR *userPtr3;
-    struct dirent *entry;
-
-    char users[50][50]; // an array of strings to keep all the users in a chatroom
-
-    strcpy(chatroomName, "/tmp/");
-    strcat(chatroomName, command->args[0]); // name of the chatroom -> name of the folder that we keep the users
-    strcpy(userName, chatroomName);
-    strcat(userName, "/");
-    strcat(userName, command->args[1]); // append the name of the user
-
-    chatroomPtr = opendir("/tmp");
-
-    if (chatroomPtr == NULL)
+    char **args = command->args + 1;
+    int arg_count = command->arg_count - 1;
+    bool shm = arg_count > 0 && strcmp(args[0], "--shm") == 0;
+    if (shm)
     {
+        args++;
+        arg_count--;
     }
-    else
+    if (arg_count < 3)
     {
-        while ((entry = readdir(chatroomPtr)) != NULL) // check inside the /tmp
-        {
-            if (strcmp(entry->d_name, command->args[0]) == 0) // chatroom is found, no need to create again
-            {
-                chatroomExist = 1;
-            }
-        }
+        printf("Usage: chatroom --bench [--shm] <roomname> <users> <rate> [seconds]\n");
+        return UNKNOWN;
     }
-    if (chatroomExist == 0) // chatroom is not created before
+    const char *room = args[0];
+    int users = atoi(args[1]);
+    double rate = atof(args[2]);
+    int seconds = arg_count > 3 ? atoi(args[3]) : CHAT_BENCH_SECONDS;
+    if (users < 1 || users > CHAT_MAX_MEMBERS || rate <= 0 || seconds < 1)
     {
-        mkdir(chatroomName, 0777); // create the directory with the given name and handle the permissions
+        printf("-%s: chatroom: need 1-%d users, a positive rate and duration\n", sysname, CHAT_MAX_MEMBERS);
+        return UNKNOWN;
     }
-    else
-    {
-        userPtr = opendir(chatroomName);
+    uint64_t interval = (uint64_t)(1e9 * users / rate); // each member's share of the rate
 
-        if (userPtr == NULL)
+    int ready[2], start[2];
+    pipe(ready);
+    pipe(start);
+    int *results = malloc(sizeof(int) * users);
+    for (int i = 0; i < users; i++)
+    {
+        int out[2];
+        pipe(out);
+        fflush(stdout);
+        if (fork() == 0)
         {
+            char user[32];
+            snprintf(user, sizeof(user), "bench%d", i);
+            close(ready[0]);
+            close(start[1]);
+            close(out[0]);
+            srand48(getpid());
+            chat_bench_member(room, user, users, interval, seconds, shm, ready[1], start[0], out[1]);
         }
-        else
+        close(out[1]);
+        results[i] = out[0];
+    }
+    close(ready[1]);
+    close(start[0]);
+
+    int joined = 0;
+    char c;
+    while (joined < users && read(ready[0], &c, 1) == 1)
+        joined++;
+    printf("%d members joined %s, sending %.0f messages/s for %d s\n", joined, room, rate, seconds);
+    fflush(stdout);
+    close(start[1]); // go
+
+    struct chat_bench_report_t total = {0};
+    uint64_t *latencies = NULL;
+    for (int i = 0; i < users; i++)
+    {
+        struct chat_bench_report_t report;
+        if (read(results[i], &report, sizeof(report)) != sizeof(report))
         {
-            while ((entry = readdir(userPtr)) != NULL) // check inside the chatroom
-            {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) // don't need to check these
-                {
-                }
-                else
-                {
-                    char username[50];
-                    strcpy(username, chatroomName);
-                    strcat(username, "/");
-                    strcat(username, entry->d_name);
-                    strcpy(users[numberOfUser], username);
-                    numberOfUser++;
-                    if (strcmp(entry->d_name, command->args[1]) == 0) // user is created before
-                    {
-                        userExist = 1;
-                    }
-                }
-            }
+            close(results[i]);
+            continue;
         }
+        latencies = realloc(latencies, sizeof(uint64_t) * (total.count + report.count));
+        size_t want = sizeof(uint64_t) * report.count, got = 0;
+        ssize_t n;
+        while (got < want && (n = read(results[i], (char *)(latencies + total.count) + got, want - got)) > 0)
+            got += n;
+        total.sent += report.sent;
+        total.received += report.received;
+        total.dropped += report.dropped;
+        total.queued += report.queued;
+        total.count += got / sizeof(uint64_t);
+        close(results[i]);
+    }
+    while (wait(NULL) > 0)
+        ;
+    close(ready[0]);
+    free(results);
+
+    long expected = total.sent * joined; // everybody, including the sender, gets every message
+    printf("sent %ld messages, %ld deliveries expected, %ld delivered (%.1f/s)\n", total.sent, expected,
+           total.received, (double)total.received / seconds);
+    printf("dropped %ld %s, %ld still queued, %ld lost\n", total.dropped, shm ? "by lapped readers" : "from full queues",
+           total.queued, expected - total.received);
+    if (total.count > 0)
+    {
+        qsort(latencies, total.count, sizeof(uint64_t), compare_latencies);
+        printf("latency p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+               latencies[total.count / 2] / 1e6, latencies[total.count * 99 / 100] / 1e6,
+               latencies[total.count * 999 / 1000] / 1e6, latencies[total.count - 1] / 1e6);
     }
+    free(latencies);
+    return SUCCESS;
+}
 
-    if (userExist == 0) // user does not exist
+/**
+ * Reader thread of a --shm session: print messages from the ring as they
+ * are published
+ * @param  arg the room
+ * @return     [description]
+ */
+void *chat_shm_reader(void *arg)
+{
+    struct chat_room_t *room = arg;
+    long missed = 0, reported = 0;
+    while (1)
     {
-        strcpy(users[numberOfUser], userName); // add the new user's info to the users array
-        numberOfUser++;
-        if (mkfifo(userName, 0777) == -1) // create a named pipe with the given user name and handle the permissions
+        chat_shm_drain(room->ring, &room->next, chat_print_frame, NULL, &missed);
+        if (missed > reported)
         {
-            printf("Failed to pipe\n");
+            printf("(%ld messages missed)\n", missed - reported);
+            reported = missed;
         }
+        fflush(stdout);
+        chat_shm_wait(room->ring, room->next, -1);
+    }
+    return NULL;
+}
+
+/**
+ * A --shm session: a thread follows the ring while this one sends what is
+ * typed
+ * @param  room [description]
+ * @return      [description]
+ */
+int chat_shm_loop(struct chat_room_t *room)
+{
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, chat_shm_reader, room) != 0)
+        return -1;
+    printf("%s write your message here:\n", room->user);
+    fflush(stdout);
+
+    char typed[CHAT_MAX_MESSAGE];
+    while (fgets(typed, sizeof(typed), stdin) != NULL)
+    {
+        typed[strcspn(typed, "\n")] = '\0';
+        chat_send(room, typed);
     }
+    return 0;
+}
 
-    // pid_t pids[numberOfUser];
-    char messageSent[450];
-    char messageReceived[450];
-    strcpy(messageSent, "");
+void chatroom(struct command_t *command)
+{
+    if (command->arg_count > 0 && strcmp(command->args[0], "--bench") == 0)
+    {
+        chat_bench(command);
+        return;
+    }
 
-    for (int i = 0; i < numberOfUser; i++)
+    // --replay N shows the last N messages on joining, --since T those sent
+    // since T (seconds since the epoch, or before now if negative), --shm
+    // joins through the room's shared-memory ring instead of FIFOs
+    long replay = CHAT_REPLAY_DEFAULT;
+    uint64_t since = 0;
+    bool shm = false;
+    char **args = command->args;
+    int arg_count = command->arg_count;
+    while (arg_count >= 1 && (strcmp(args[0], "--replay") == 0 || strcmp(args[0], "--since") == 0 ||
+                              strcmp(args[0], "--shm") == 0))
     {
-        pid_t pid = fork();
-        if (pid == 0) // child process
+        if (strcmp(args[0], "--shm") == 0)
         {
-            // print a message everytime someone new joined to the conversation
-            strcat(messageSent, "[");
-            strcat(messageSent, command->args[0]);
-            strcat(messageSent, "] ");
-            strcat(messageSent, command->args[1]);
-            strcat(messageSent, ": ");
-            strcat(messageSent, command->args[1]);
-            strcat(messageSent, " joined!");
-
-            // send a message by writing into every pipe in the chatroom:
-            int fd = open(users[i], O_WRONLY);
-            write(fd, &messageSent, sizeof(messageSent));
-            close(fd);
-
-            kill(getpid(), SIGTERM);
+            shm = true;
+            args++;
+            arg_count--;
+            continue;
         }
+        if (arg_count < 2)
+            break;
+        if (strcmp(args[0], "--replay") == 0)
+            replay = atol(args[1]);
         else
         {
+            long seconds = atol(args[1]);
+            replay = -1;
+            since = (uint64_t)(seconds < 0 ? time(NULL) + seconds : seconds) * 1000000000;
         }
+        args += 2;
+        arg_count -= 2;
     }
+    if (arg_count < 2)
+    {
+        printf("Usage: chatroom [--shm] [--replay N | --since T] <roomname> <username>\n");
+        return;
+    }
+    printf("Chatroom name: %s\n", args[0]);
+    printf("User: %s\n", args[1]);
 
-    printf("Welcome to %s!\n", command->args[0]); // print a welcome message with the name of the chatroom
+    static struct chat_room_t room; // too big for the stack
+    int fifo = shm ? chat_join_shm(&room, args[0], args[1]) : chat_join(&room, args[0], args[1]);
+    if (fifo == -1)
+        return;
 
-    while (1) // each user receives a message by continuously reading from their named pipe
-    {
-        char messageSent[450];
-        char messageReceived[450];
-        strcpy(messageSent, "");
+    printf("Welcome to %s!\n", room.name); // print a welcome message with the name of the chatroom
+    if (replay != 0)
+        chat_log_replay(&room.log, replay, since, chat_print_frame, NULL);
 
-        int fd1 = open(userName, O_RDONLY);
-        read(fd1, &messageReceived, sizeof(messageReceived));
-        close(fd1);
+    // print a message everytime someone new joined to the conversation
+    char notice[NAME_MAX + 16];
+    snprintf(notice, sizeof(notice), "%s joined!", room.user);
+    chat_send(&room, notice);
 
-        printf("%s\n", messageReceived);
-        printf("%s write your message here:\n", command->args[1]);
+    if (shm)
+        chat_shm_loop(&room);
+    else
+        chat_loop(&room, fifo);
 
-        // get the message from the user:
-        char messageToSent[450];
-        fgets(messageToSent, 450, stdin);
+    snprintf(notice, sizeof(notice), "%s left!", room.user);
+    chat_send(&room, notice);
+    if (shm)
+        chat_shm_close(room.name, room.ring, room.ring_lock);
+    else
+        close(fifo);
+    if (room.inotify != -1)
+        close(room.inotify);
+}
 
-        for (int i = 0; i < numberOfUser; i++)
-        {
-            pid_t pid2 = fork();
-            if (pid2 == 0) // child process
-            {
-                strcat(messageSent, "[");
-                strcat(messageSent, command->args[0]);
-                strcat(messageSent, "] ");
-                strcat(messageSent, command->args[1]);
-                strcat(messageSent, ": ");
-                strcat(messageSent, messageToSent);
-
-                int fd2 = open(users[i], O_WRONLY);
-                write(fd2, &messageSent, sizeof(messageSent));
-                close(fd2);
-
-                kill(getpid(), SIGTERM);
-            }
-            else
-            {
-            }
-        }
-    }
+int chatroom_builtin(struct command_t *command)
+{
+    chatroom(command);
+    return SUCCESS;
 }
 
 // Custom Command - Tuna
@@ -1010,21 +7283,312 @@ void guessGame(int guess, int goal, int lower, int higher, int *shot)
     }
 }
 
+int guess_game_builtin(struct command_t *command) // custom command "guessGame"
+{
+    if (command->arg_count != 1)
+    {
+        printf("Please enter valid arguments\n");
+        return SUCCESS;
+    }
+    int size = atoi(command->args[0]);
+    srand(getpid()); // Initialization, should only be called once.
+    int r = rand() % size;
+    int firstGuess;
+    int shott = 1;
+    printf("Welcome to guess game please enter your first guess: ");
+    scanf("%d", &firstGuess);
+    guessGame(firstGuess, r, 0, size, &shott);
+    return SUCCESS;
+}
+
 // Custom Command - Yesim
-void wordGame(char word[], int *chance) // takes the word to be guessed in the game,  and the number of chances the user have
+#define WORD_MAX_LENGTH 32          // longest word the game plays with
+#define WORD_INDEX_MAGIC 0x78646977 // "widx"
+#define WORD_CHANCES 6              // guesses the player gets
+
+// The sidecar index <dictionary>.idx lists the offset of every word,
+// grouped by length, so that picking a word of a given length is one
+// random number. It is rebuilt whenever the dictionary's size or mtime
+// no longer matches the ones recorded in it.
+
+struct word_index_header_t
+{
+    uint32_t magic;
+    uint32_t count;
+    uint64_t dictionary_size;
+    int64_t dictionary_mtime_sec;
+    int64_t dictionary_mtime_nsec;
+    uint32_t length_start[WORD_MAX_LENGTH + 2]; // words of length n are offsets[length_start[n]..length_start[n + 1])
+};
+
+struct dictionary_t
+{
+    const char *data; // the mapped word list
+    size_t size;
+    const struct word_index_header_t *header;
+    const uint32_t *offsets;
+    void *index;       // mapping or malloc'd block holding header and offsets
+    size_t index_size;
+    bool index_mapped;
+    uint32_t *set;     // open-addressing hash set of offsets + 1, for one word length
+    uint32_t set_size; // a power of two
+};
+
+/**
+ * Length of the word at an offset in the dictionary
+ * @param  dict   [description]
+ * @param  offset [description]
+ * @return        [description]
+ */
+size_t word_length(struct dictionary_t *dict, uint32_t offset)
+{
+    const char *end = memchr(dict->data + offset, '\n', dict->size - offset);
+    size_t length = (end ? end : dict->data + dict->size) - (dict->data + offset);
+    if (length > 0 && dict->data[offset + length - 1] == '\r')
+        length--;
+    return length;
+}
+
+/**
+ * Build the offset index of a mapped dictionary in memory
+ * @param  dict [description]
+ * @param  st   the dictionary's stat, recorded in the index
+ * @return      0, -1 on failure
+ */
+int build_word_index(struct dictionary_t *dict, struct stat *st)
+{
+    uint32_t counts[WORD_MAX_LENGTH + 2] = {0};
+    uint32_t total = 0;
+    for (size_t offset = 0; offset < dict->size;)
+    {
+        size_t length = word_length(dict, offset);
+        if (length > 0 && length <= WORD_MAX_LENGTH)
+        {
+            counts[length]++;
+            total++;
+        }
+        const char *end = memchr(dict->data + offset, '\n', dict->size - offset);
+        offset = end ? (size_t)(end - dict->data) + 1 : dict->size;
+    }
+
+    dict->index_size = sizeof(struct word_index_header_t) + sizeof(uint32_t) * total;
+    struct word_index_header_t *header = calloc(1, dict->index_size);
+    uint32_t *offsets = (uint32_t *)(header + 1);
+    header->magic = WORD_INDEX_MAGIC;
+    header->count = total;
+    header->dictionary_size = st->st_size;
+    header->dictionary_mtime_sec = st->st_mtim.tv_sec;
+    header->dictionary_mtime_nsec = st->st_mtim.tv_nsec;
+    for (int n = 1; n <= WORD_MAX_LENGTH + 1; n++) // a counting sort by length
+        header->length_start[n] = header->length_start[n - 1] + counts[n - 1];
+
+    uint32_t fill[WORD_MAX_LENGTH + 2];
+    memcpy(fill, header->length_start, sizeof(fill));
+    for (size_t offset = 0; offset < dict->size;)
+    {
+        size_t length = word_length(dict, offset);
+        if (length > 0 && length <= WORD_MAX_LENGTH)
+            offsets[fill[length]++] = offset;
+        const char *end = memchr(dict->data + offset, '\n', dict->size - offset);
+        offset = end ? (size_t)(end - dict->data) + 1 : dict->size;
+    }
+    dict->index = header;
+    dict->index_mapped = false;
+    return 0;
+}
+
+/**
+ * Open a dictionary: map the word list and its sidecar index, building
+ * and saving the index first if it is missing or out of date
+ * @param  dict [description]
+ * @param  path [description]
+ * @return      0, -1 if the word list cannot be read
+ */
+int open_dictionary(struct dictionary_t *dict, const char *path)
+{
+    memset(dict, 0, sizeof(struct dictionary_t));
+    struct stat st;
+    if (stat(path, &st) == -1 || st.st_size == 0 || st.st_size > UINT32_MAX)
+        return -1;
+    dict->data = map_input(path, &dict->size);
+    if (dict->data == NULL)
+        return -1;
+
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%.4000s.idx", path);
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    struct stat index_st;
+    if (fd != -1 && fstat(fd, &index_st) == 0 && index_st.st_size >= (off_t)sizeof(struct word_index_header_t))
+    {
+        void *index = mmap(NULL, index_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        const struct word_index_header_t *header = index;
+        if (index != MAP_FAILED && header->magic == WORD_INDEX_MAGIC && header->dictionary_size == (uint64_t)st.st_size &&
+            header->dictionary_mtime_sec == st.st_mtim.tv_sec && header->dictionary_mtime_nsec == st.st_mtim.tv_nsec &&
+            index_st.st_size == (off_t)(sizeof(struct word_index_header_t) + sizeof(uint32_t) * header->count))
+        {
+            dict->index = index;
+            dict->index_size = index_st.st_size;
+            dict->index_mapped = true;
+        }
+        else if (index != MAP_FAILED)
+            munmap(index, index_st.st_size);
+    }
+    if (fd != -1)
+        close(fd);
+
+    if (dict->index == NULL)
+    {
+        build_word_index(dict, &st);
+        // save it for next time; a dictionary in a read-only place is simply indexed every run
+        char temp[PATH_MAX + 16];
+        snprintf(temp, sizeof(temp), "%s.%d", index_path, getpid());
+        int out = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out != -1)
+        {
+            bool written = write(out, dict->index, dict->index_size) == (ssize_t)dict->index_size;
+            close(out);
+            if (!written || rename(temp, index_path) == -1)
+                unlink(temp);
+        }
+    }
+    dict->header = dict->index;
+    dict->offsets = (const uint32_t *)(dict->header + 1);
+    return 0;
+}
+
+/**
+ * Number of words of a length in the dictionary
+ * @param  dict   [description]
+ * @param  length [description]
+ * @return        [description]
+ */
+uint32_t count_words(struct dictionary_t *dict, size_t length)
+{
+    if (length == 0 || length > WORD_MAX_LENGTH)
+        return 0;
+    return dict->header->length_start[length + 1] - dict->header->length_start[length];
+}
+
+/**
+ * Put the words of one length into the dictionary's hash set
+ * @param dict   [description]
+ * @param length [description]
+ */
+void build_word_set(struct dictionary_t *dict, size_t length)
+{
+    uint32_t count = count_words(dict, length);
+    dict->set_size = 16;
+    while (dict->set_size < count * 2)
+        dict->set_size *= 2;
+    dict->set = calloc(dict->set_size, sizeof(uint32_t));
+    for (uint32_t i = dict->header->length_start[length]; i < dict->header->length_start[length + 1]; i++)
+    {
+        uint32_t slot = history_hash(dict->data + dict->offsets[i], length) & (dict->set_size - 1);
+        while (dict->set[slot] != 0)
+            slot = (slot + 1) & (dict->set_size - 1);
+        dict->set[slot] = dict->offsets[i] + 1;
+    }
+}
+
+/**
+ * Whether a word is in the dictionary's hash set
+ * @param  dict   [description]
+ * @param  word   [description]
+ * @param  length [description]
+ * @return        [description]
+ */
+bool is_word(struct dictionary_t *dict, const char *word, size_t length)
+{
+    uint32_t slot = history_hash(word, length) & (dict->set_size - 1);
+    for (; dict->set[slot] != 0; slot = (slot + 1) & (dict->set_size - 1))
+    {
+        uint32_t offset = dict->set[slot] - 1;
+        if (word_length(dict, offset) == length && memcmp(dict->data + offset, word, length) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The word builtin: "word [-f dictionary] [-n length]" picks a random word
+ * of the given length (5 by default) from the dictionary (words.txt by
+ * default) and lets the user guess it
+ * @param  command [description]
+ * @return         [description]
+ */
+int word_builtin(struct command_t *command)
+{
+    const char *path = "words.txt";
+    int length = 5;
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        if (strcmp(command->args[i], "-f") == 0 && i + 1 < command->arg_count)
+            path = command->args[++i];
+        else if (strcmp(command->args[i], "-n") == 0 && i + 1 < command->arg_count)
+            length = atoi(command->args[++i]);
+        else
+        {
+            printf("Usage: word [-f dictionary] [-n length]\n");
+            last_status = 2;
+            return SUCCESS;
+        }
+    }
+
+    struct dictionary_t dict;
+    if (open_dictionary(&dict, path) == -1)
+    {
+        printf("Sorry, could not read %s.\n", path);
+        last_status = 1;
+        return SUCCESS;
+    }
+    uint32_t count = count_words(&dict, length);
+    if (count == 0)
+    {
+        printf("Sorry, %s has no %d letter words.\n", path, length);
+        last_status = 1;
+        return SUCCESS;
+    }
+    build_word_set(&dict, length);
+
+    srand48(time(NULL) ^ getpid());
+    char word[WORD_MAX_LENGTH + 1];
+    uint32_t offset = dict.offsets[dict.header->length_start[length] + lrand48() % count];
+    memcpy(word, dict.data + offset, length);
+    word[length] = '\0';
+
+    // prints the necessary information to play the game
+    printGameInfo(length);
+
+    // call the game with the selected word and the number of chances
+    int chance = WORD_CHANCES;
+    wordGame(&dict, word, &chance);
+    return SUCCESS;
+}
+
+void wordGame(struct dictionary_t *dict, const char *word, int *chance) // takes the word to be guessed in the game,  and the number of chances the user have
 {
     // will count the number of letters that are in the right location
-    // correctness == 5 means the word is guessed correctly
+    // correctness == length means the word is guessed correctly
     int correctness = 0;
+    int length = strlen(word);
 
-    char guess[7];
+    char guess[256];
 
-    // Get the guess from the user
-    printf("Enter a guess: ");
-    fgets(guess, 7, stdin);
+    // Get the guess from the user; guesses that are not words cost nothing
+    while (1)
+    {
+        printf("Enter a guess: ");
+        fflush(stdout);
+        if (fgets(guess, sizeof(guess), stdin) == NULL)
+            return;
+        guess[strcspn(guess, "\r\n")] = '\0';
+        if ((int)strlen(guess) == length && is_word(dict, guess, length))
+            break;
+        printf("Not a %d letter word in the list, try again.\n", length);
+    }
 
     // Compare each char of the guess string and the wordle string
-    for (int i = 0; i < 5; i++)
+    for (int i = 0; i < length; i++)
     {
         if (guess[i] == word[i]) // the letter user guessed is in the right location.
         {
@@ -1034,9 +7598,7 @@ void wordGame(char word[], int *chance) // takes the word to be guessed in the g
             reset();
         }
         // Check if the current letter is same as any of the letters in the word. If not, it should be printed in red
-        else if (guess[i] != word[0] && guess[i] != word[1] &&
-                 guess[i] != word[2] && guess[i] != word[3] &&
-                 guess[i] != word[4])
+        else if (memchr(word, guess[i], length) == NULL)
         {
             red();
             printf("%c", guess[i]);
@@ -1052,7 +7614,7 @@ void wordGame(char word[], int *chance) // takes the word to be guessed in the g
     printf("\n"); // After printing and coloring the guess string
     (*chance)--;  // User lost 1 chance, decrement the chance
 
-    if (correctness == 5 && (*chance) >= 0) // all the letters are guessed correctly. Do not call the function recursively.
+    if (correctness == length && (*chance) >= 0) // all the letters are guessed correctly. Do not call the function recursively.
     {
         blue();
         printf("Correct!\n");
@@ -1063,14 +7625,14 @@ void wordGame(char word[], int *chance) // takes the word to be guessed in the g
         blue();
         printf("%d chances left. Almost there, try again.\n", *chance);
         reset();
-        wordGame(word, chance);
+        wordGame(dict, word, chance);
     }
     else if ((*chance) > 0) // user still has chances, so call the function recursively, and print out the chances left.
     {
         blue();
         printf("%d chances left. Try again.\n", *chance);
         reset();
-        wordGame(word, chance);
+        wordGame(dict, word, chance);
     }
     else if ((*chance) == 0) // no chances left, print out the actual word
     {
@@ -1078,16 +7640,16 @@ void wordGame(char word[], int *chance) // takes the word to be guessed in the g
         printf("Sorry:(( The word you were looking for : ");
         reset();
         cyan();
-        printf("%s", word);
+        printf("%s\n", word);
         reset();
     }
 }
 
 // helper function for the wordGame
-void printGameInfo()
+void printGameInfo(int length)
 {
     purple();
-    printf("Guess a 5 letter word. Do not use capital letters.");
+    printf("Guess a %d letter word. Do not use capital letters.", length);
     reset();
     green();
     printf("\nGreen letters: ");